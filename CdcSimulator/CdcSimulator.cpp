@@ -0,0 +1,305 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CdcSimulator.h"
+#include "IqrfLogging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <random>
+
+typedef std::basic_string<unsigned char> ustring;
+
+const unsigned char CDC_CR = 0x0D;
+const unsigned char SPI_READY_COMM = 0x80;
+
+inline ustring toUstring(const char* str)
+{
+  return ustring((const unsigned char*)str, strlen(str));
+}
+
+CdcSimulator::CdcSimulator(const Config& cfg)
+  :m_cfg(cfg)
+  , m_masterFd(-1)
+  , m_slaveFd(-1)
+{
+  m_commands = 0;
+  m_dataReceived = 0;
+  m_busyReplies = 0;
+  m_errReplies = 0;
+  m_asyncSent = 0;
+
+  m_masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (m_masterFd < 0) {
+    THROW_EX(CdcSimulatorException, "posix_openpt failed: " << errno);
+  }
+
+  if (0 != grantpt(m_masterFd) || 0 != unlockpt(m_masterFd)) {
+    close(m_masterFd);
+    THROW_EX(CdcSimulatorException, "grantpt/unlockpt failed: " << errno);
+  }
+  m_portName = ptsname(m_masterFd);
+
+  // keep the slave open so the master doesn't read EIO while the channel reopens the port
+  m_slaveFd = open(m_portName.c_str(), O_RDWR | O_NOCTTY);
+  if (m_slaveFd < 0) {
+    close(m_masterFd);
+    THROW_EX(CdcSimulatorException, "open slave failed: " << PAR(m_portName) << errno);
+  }
+  struct termios tio;
+  tcgetattr(m_slaveFd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(m_slaveFd, TCSANOW, &tio);
+
+  if (0 != pipe(m_wakeFd)) {
+    close(m_slaveFd);
+    close(m_masterFd);
+    THROW_EX(CdcSimulatorException, "pipe failed: " << errno);
+  }
+
+  TRC_INF("CDC simulator port: " << PAR(m_portName));
+
+  m_runThread = true;
+  m_thread = std::thread(&CdcSimulator::run, this);
+}
+
+CdcSimulator::~CdcSimulator()
+{
+  m_runThread = false;
+  char c = 0;
+  if (write(m_wakeFd[1], &c, 1) < 0) {
+    TRC_WAR("wake up write failed: " << errno);
+  }
+
+  TRC_DBG("joining simulator thread");
+  if (m_thread.joinable())
+    m_thread.join();
+  TRC_DBG("simulator thread joined");
+
+  close(m_wakeFd[0]);
+  close(m_wakeFd[1]);
+  close(m_slaveFd);
+  close(m_masterFd);
+}
+
+void CdcSimulator::setResponder(ResponderFunc responderFunc)
+{
+  std::lock_guard<std::mutex> lck(m_responderMtx);
+  m_responderFunc = responderFunc;
+}
+
+void CdcSimulator::sendAsyncData(const ustring& data)
+{
+  if (data.size() > 0xFF) {
+    THROW_EX(CdcSimulatorException, "async data too long: " << NAME_PAR(size, data.size()));
+  }
+  ustring msg = toUstring("<DR");
+  msg.push_back((unsigned char)data.size());
+  msg.push_back(':');
+  msg += data;
+  msg.push_back(CDC_CR);
+  reply(msg);
+  m_asyncSent++;
+}
+
+CdcSimulator::Stats CdcSimulator::getStats() const
+{
+  Stats stats;
+  stats.commands = m_commands;
+  stats.dataReceived = m_dataReceived;
+  stats.busyReplies = m_busyReplies;
+  stats.errReplies = m_errReplies;
+  stats.asyncSent = m_asyncSent;
+  return stats;
+}
+
+void CdcSimulator::run()
+{
+  TRC_ENTER("thread starts");
+
+  ustring buf;
+  unsigned char rx[512];
+
+  while (m_runThread) {
+    struct pollfd fds[2];
+    fds[0].fd = m_masterFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wakeFd[0];
+    fds[1].events = POLLIN;
+
+    int res = poll(fds, 2, -1);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      TRC_WAR("poll failed: " << errno);
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    ssize_t recn = read(m_masterFd, rx, sizeof(rx));
+    if (recn <= 0) {
+      if (recn < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      TRC_WAR("read failed: " << PAR(recn) << errno);
+      break;
+    }
+    buf.append(rx, recn);
+
+    // process all complete commands
+    while (true) {
+      size_t start = buf.find('>');
+      if (start == ustring::npos) {
+        buf.clear();
+        break;
+      }
+      buf.erase(0, start);
+      size_t used = processCommand(buf);
+      if (used == 0)
+        break;
+      buf.erase(0, used);
+    }
+  }
+
+  TRC_LEAVE("thread stopped");
+}
+
+size_t CdcSimulator::processCommand(const ustring& buf)
+{
+  ustring cmd;
+  ustring data;
+  size_t used = 0;
+
+  if (buf.compare(0, 3, toUstring(">DS")) == 0) {
+    // data may contain CR, its length is given by the byte after the command followed by ':'
+    if (buf.size() < 5)
+      return 0;
+    if (buf[4] != ':') {
+      TRC_WAR("Malformed data send command, skipped");
+      return 1;
+    }
+    size_t len = buf[3];
+    if (buf.size() < 5 + len + 1)
+      return 0;
+    cmd = toUstring("DS");
+    data = buf.substr(5, len);
+    used = 5 + len + 1;
+  }
+  else {
+    size_t end = buf.find(CDC_CR);
+    if (end == ustring::npos)
+      return 0;
+    cmd = buf.substr(1, end - 1);
+    used = end + 1;
+  }
+
+  m_commands++;
+  if (m_cfg.latency.count() > 0) {
+    std::this_thread::sleep_for(m_cfg.latency);
+  }
+
+  if (cmd.empty()) {
+    reply(toUstring("<OK\r"));
+  }
+  else if (cmd == toUstring("R")) {
+    reply(toUstring("<R:OK\r"));
+  }
+  else if (cmd == toUstring("RT")) {
+    reply(toUstring("<RT:OK\r"));
+  }
+  else if (cmd == toUstring("S")) {
+    ustring msg = toUstring("<S");
+    msg.push_back(SPI_READY_COMM);
+    msg.push_back(':');
+    msg.push_back(CDC_CR);
+    reply(msg);
+  }
+  else if (cmd == toUstring("I")) {
+    reply(toUstring("<I:CDC-SIM#01.00#00000000\r"));
+  }
+  else if (cmd == toUstring("IT")) {
+    ustring msg = toUstring("<IT:");
+    msg.append(8, 0);
+    msg.push_back(CDC_CR);
+    reply(msg);
+  }
+  else if (cmd == toUstring("DS")) {
+    if (chance(m_cfg.busyProbability)) {
+      m_busyReplies++;
+      reply(toUstring("<DS:BUSY\r"));
+    }
+    else if (chance(m_cfg.errProbability)) {
+      m_errReplies++;
+      reply(toUstring("<DS:ERR\r"));
+    }
+    else {
+      m_dataReceived++;
+      reply(toUstring("<DS:OK\r"));
+
+      ustring response;
+      {
+        std::lock_guard<std::mutex> lck(m_responderMtx);
+        if (m_responderFunc) {
+          response = m_responderFunc(data);
+        }
+      }
+      if (!response.empty()) {
+        if (m_cfg.latency.count() > 0) {
+          std::this_thread::sleep_for(m_cfg.latency);
+        }
+        sendAsyncData(response);
+      }
+    }
+  }
+  else {
+    TRC_WAR("Unknown command: " << std::endl << FORM_HEX(cmd.data(), cmd.size()));
+  }
+
+  return used;
+}
+
+void CdcSimulator::reply(const ustring& msg)
+{
+  std::lock_guard<std::mutex> lck(m_writeMtx);
+  size_t written = 0;
+  while (written < msg.size()) {
+    ssize_t res = write(m_masterFd, msg.data() + written, msg.size() - written);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      TRC_WAR("write failed: " << errno);
+      return;
+    }
+    written += res;
+  }
+}
+
+bool CdcSimulator::chance(double probability)
+{
+  if (probability <= 0)
+    return false;
+  static thread_local std::minstd_rand engine((unsigned)
+    std::chrono::steady_clock::now().time_since_epoch().count());
+  std::uniform_real_distribution<double> dist(0, 1);
+  return dist(engine) < probability;
+}
@@ -0,0 +1,128 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+/// \class CdcSimulator
+/// \brief Simulated IQRF USB CDC device on a pseudo-terminal
+/// \details
+/// Creates a pty pair and serves the CDC command protocol on the master side in a dedicated thread.
+/// The slave side name is passed to IqrfCdcChannel (CDCImpl) as a serial port.
+/// Supported commands: test ">", reset ">R", ">RT", status ">S", device info ">I", ">IT"
+/// and data send ">DS<len>:<data>". Data send is refused by "<DS:BUSY" with configured probability.
+/// Asynchronous data "<DR<len>:<data>" are sent by sendAsyncData() or generated by the responder function.
+/// Linux only.
+class CdcSimulator
+{
+public:
+  /// Simulator parameters
+  struct Config
+  {
+    Config()
+      :latency(0)
+      , busyProbability(0)
+      , errProbability(0)
+    {}
+
+    /// delay of each reply
+    std::chrono::microseconds latency;
+    /// probability <0, 1> of "<DS:BUSY" reply
+    double busyProbability;
+    /// probability <0, 1> of "<DS:ERR" reply
+    double errProbability;
+  };
+
+  /// Simulator statistics
+  struct Stats
+  {
+    uint64_t commands;
+    uint64_t dataReceived;
+    uint64_t busyReplies;
+    uint64_t errReplies;
+    uint64_t asyncSent;
+  };
+
+  /// Gets data accepted by ">DS", returns data to be sent back by "<DR" or empty string for no reply
+  typedef std::function<std::basic_string<unsigned char>(const std::basic_string<unsigned char>&)> ResponderFunc;
+
+  CdcSimulator(const Config& cfg = Config());
+  virtual ~CdcSimulator();
+
+  /// \brief Get name of the slave pty to be opened as the CDC port
+  const std::string& getPortName() const { return m_portName; }
+
+  /// \brief Set function generating asynchronous replies to accepted data
+  void setResponder(ResponderFunc responderFunc);
+
+  /// \brief Send asynchronous data "<DR" to the host
+  void sendAsyncData(const std::basic_string<unsigned char>& data);
+
+  Stats getStats() const;
+
+private:
+  CdcSimulator(const CdcSimulator&);
+  CdcSimulator& operator = (const CdcSimulator&);
+  void run();
+  size_t processCommand(const std::basic_string<unsigned char>& buf);
+  void reply(const std::basic_string<unsigned char>& msg);
+  bool chance(double probability);
+
+  Config m_cfg;
+  int m_masterFd;
+  int m_slaveFd;
+  int m_wakeFd[2];
+  std::string m_portName;
+
+  std::mutex m_writeMtx;
+  std::mutex m_responderMtx;
+  ResponderFunc m_responderFunc;
+
+  std::atomic<uint64_t> m_commands;
+  std::atomic<uint64_t> m_dataReceived;
+  std::atomic<uint64_t> m_busyReplies;
+  std::atomic<uint64_t> m_errReplies;
+  std::atomic<uint64_t> m_asyncSent;
+
+  std::atomic_bool m_runThread;
+  std::thread m_thread;
+};
+
+class CdcSimulatorException : public std::exception {
+public:
+  CdcSimulatorException(const std::string& cause)
+    :m_cause(cause)
+  {}
+
+  virtual const char* what() const noexcept(true)
+  {
+    return m_cause.c_str();
+  }
+
+  virtual ~CdcSimulatorException()
+  {}
+
+protected:
+  std::string m_cause;
+};
@@ -16,58 +16,399 @@
 
 #include "IqrfCdcChannel.h"
 #include "IqrfLogging.h"
+#include "PlatformDep.h"
 #include <thread>
 #include <chrono>
+#include <exception>
+
+#ifndef WIN
+#include <unistd.h>
+#endif
+
+inline int64_t nowMs()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 IqrfCdcChannel::IqrfCdcChannel(const std::string& portIqrf)
-  : m_cdc(portIqrf.c_str())
+  :IqrfCdcChannel(portIqrf, Config())
+{
+}
+
+IqrfCdcChannel::IqrfCdcChannel(const std::string& portIqrf, const Config& cfg)
+  : m_port(portIqrf)
+  , m_cdc(nullptr)
+  , m_busyRetry(cfg.busyRetry)
+  , m_connectRetry(cfg.connectRetry)
+  , m_asyncConnect(cfg.asyncConnect)
+  , m_maxPendingMessages(cfg.maxPendingMessages)
+  , m_stateChangeFunc(cfg.stateChangeFunc)
+  , m_lastProbeLatency(0)
+  , m_healthProbePeriod(cfg.healthProbePeriod)
+  , m_runHealthThread(false)
 {
-  if (!m_cdc.test()) {
-    THROW_EX(CDCImplException, "CDC Test failed");
+  m_sent = 0;
+  m_probes = 0;
+  m_probeFailures = 0;
+  m_reconnects = 0;
+  m_pendingDropped = 0;
+  m_lastActivity = nowMs();
+  m_state = State::NotReady;
+
+  if (!m_asyncConnect) {
+    m_cdc = ant_new CDCImpl(m_port.c_str());
+    if (!m_cdc->test()) {
+      delete m_cdc;
+      THROW_EX(CDCImplException, "CDC Test failed");
+    }
+    m_state = State::Ready;
+  }
+
+  // in asyncConnect mode the health thread connects first
+  if (m_asyncConnect || m_healthProbePeriod.count() > 0) {
+    m_runHealthThread = true;
+    m_healthThread = std::thread(&IqrfCdcChannel::healthProbe, this);
   }
 }
 
 IqrfCdcChannel::~IqrfCdcChannel()
 {
+  {
+    std::unique_lock<std::mutex> lck(m_healthMtx);
+    m_runHealthThread = false;
+  }
+  m_healthCondition.notify_all();
+
+  TRC_DBG("joining health probe thread");
+  if (m_healthThread.joinable())
+    m_healthThread.join();
+  TRC_DBG("health probe thread joined");
+
+  delete m_cdc;
 }
 
 void IqrfCdcChannel::sendTo(const std::basic_string<unsigned char>& message)
+{
+  if (m_asyncConnect) {
+    std::lock_guard<std::mutex> lck(m_pendingMtx);
+    // keep order with messages still waiting for flush
+    if (m_state != State::Ready || !m_pending.empty()) {
+      if (m_pending.size() >= m_maxPendingMessages) {
+        THROW_EX(CDCImplException, "CDC not ready, pending queue full: " << PAR(m_port) << PAR(m_maxPendingMessages));
+      }
+      TRC_DBG("CDC not ready, message queued: " << NAME_PAR(pending, m_pending.size()));
+      m_pending.push(message);
+      return;
+    }
+  }
+  send(message);
+}
+
+void IqrfCdcChannel::send(const std::basic_string<unsigned char>& message)
 {
   static int counter = 0;
   DSResponse dsResponse = DSResponse::BUSY;
-  int attempt = 0;
+  RetryPolicy::Backoff backoff(m_busyRetry);
+  std::chrono::microseconds delay;
   counter++;
 
   TRC_INF("Sending to IQRF CDC: " << std::endl << FORM_HEX(message.data(), message.size()));
 
-  while (attempt++ < 4) {
-    TRC_INF("Trying to sent: " << counter << "." << attempt);
-    dsResponse = m_cdc.sendData(message);
+  while (true) {
+    TRC_INF("Trying to sent: " << counter << "." << backoff.attempts());
+    std::exception_ptr sendError;
+    std::string error;
+    {
+      std::lock_guard<std::mutex> lck(m_cdcMtx);
+      if (m_cdc == nullptr) {
+        THROW_EX(CDCImplException, "CDC not connected: " << PAR(m_port));
+      }
+      try {
+        dsResponse = m_cdc->sendData(message);
+      }
+      catch (std::exception& e) {
+        sendError = std::current_exception();
+        error = e.what();
+      }
+    }
+    // outside m_cdcMtx, the state change handler may call sendTo()
+    if (sendError) {
+      setNotReady(error);
+      std::rethrow_exception(sendError);
+    }
     if (dsResponse != DSResponse::BUSY)
       break;
+    if (!backoff.nextDelay(delay)) {
+      TRC_WAR("CDC busy, giving up: " << NAME_PAR(attempts, backoff.attempts()));
+      break;
+    }
     //wait for next attempt
-    TRC_DBG("Sleep for a while ... ");
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    TRC_DBG("Sleep for a while ... " << NAME_PAR(us, delay.count()));
+    std::this_thread::sleep_for(delay);
+  }
+  // the device replied, without the health thread nothing else restores the state after a send failure
+  if (!m_healthThread.joinable() && m_state != State::Ready) {
+    setState(State::Ready, "");
   }
-  if (dsResponse != DSResponse::OK) {
+  if (dsResponse == DSResponse::OK) {
+    m_sent++;
+    m_lastActivity = nowMs();
+  }
+  else {
     THROW_EX(CDCImplException, "CDC send failed" << PAR(dsResponse));
   }
 }
 
 void IqrfCdcChannel::registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
 {
-  m_receiveFromFunc = receiveFromFunc;
-  m_cdc.registerAsyncMsgListener([&](unsigned char* data, unsigned int length) {
-    m_receiveFromFunc(std::basic_string<unsigned char>(data, length)); });
+  // outside m_cdcMtx, set() waits for the running handler which may call sendTo()
+  m_receiveFromFunc.set(receiveFromFunc);
+  std::lock_guard<std::mutex> lck(m_cdcMtx);
+  if (m_cdc) {
+    registerAsyncMsgListener();
+  }
+}
+
+// m_cdcMtx locked by caller
+void IqrfCdcChannel::registerAsyncMsgListener()
+{
+  m_cdc->registerAsyncMsgListener([&](unsigned char* data, unsigned int length) {
+    m_lastActivity = nowMs();
+    HandlerSlot<ReceiveFromFunc>::Reader receiveFromFunc(m_receiveFromFunc);
+    if (receiveFromFunc) {
+      (*receiveFromFunc)(std::basic_string<unsigned char>(data, length));
+    }
+  });
 }
 
 void IqrfCdcChannel::unregisterReceiveFromHandler()
 {
-  m_receiveFromFunc = ReceiveFromFunc();
-  m_cdc.unregisterAsyncMsgListener();
+  m_receiveFromFunc.reset();
+  std::lock_guard<std::mutex> lck(m_cdcMtx);
+  if (m_cdc) {
+    m_cdc->unregisterAsyncMsgListener();
+  }
+}
+
+IqrfCdcChannel::Stats IqrfCdcChannel::getStats() const
+{
+  Stats stats;
+  stats.sent = m_sent;
+  stats.busyRetries = m_busyRetry.getRetries();
+  stats.busyGiveUps = m_busyRetry.getGiveUps();
+  stats.probes = m_probes;
+  stats.probeFailures = m_probeFailures;
+  stats.reconnects = m_reconnects;
+  stats.connectRetries = m_connectRetry.getRetries();
+  stats.pendingDropped = m_pendingDropped;
+  return stats;
+}
+
+IqrfCdcChannel::Health IqrfCdcChannel::getHealth() const
+{
+  Health health;
+  std::lock_guard<std::mutex> lck(m_healthMtx);
+  health.state = m_state;
+  health.lastError = m_lastError;
+  health.lastProbeLatency = m_lastProbeLatency;
+  return health;
 }
 
 IChannel::State IqrfCdcChannel::getState()
 {
-  return State::Ready;
+  return m_state;
+}
+
+void IqrfCdcChannel::setState(State state, const std::string& error)
+{
+  State previous;
+  {
+    std::lock_guard<std::mutex> lck(m_healthMtx);
+    if (!error.empty()) {
+      m_lastError = error;
+    }
+    previous = m_state.exchange(state);
+  }
+  if (previous != state) {
+    TRC_INF("CDC state changed: " << PAR(m_port) << NAME_PAR(ready, (state == State::Ready)));
+    if (m_stateChangeFunc) {
+      m_stateChangeFunc(state);
+    }
+  }
+}
+
+void IqrfCdcChannel::setNotReady(const std::string& error)
+{
+  setState(State::NotReady, error);
+  // reconnect as soon as possible
+  m_healthCondition.notify_all();
+}
+
+void IqrfCdcChannel::healthProbe()
+{
+  TRC_ENTER("thread starts");
+
+  std::unique_lock<std::mutex> lck(m_healthMtx);
+  while (m_runHealthThread) {
+    if (m_state != State::Ready) {
+      lck.unlock();
+      connect();
+      lck.lock();
+      continue;
+    }
+
+    // asyncConnect only, woken up by setNotReady() to connect again
+    if (m_healthProbePeriod.count() == 0) {
+      m_healthCondition.wait(lck);
+      continue;
+    }
+
+    // woken up earlier by setNotReady()
+    m_healthCondition.wait_for(lck, m_healthProbePeriod);
+    if (!m_runHealthThread)
+      break;
+
+    // traffic in the last period proves the device is alive
+    if (m_state == State::Ready && nowMs() - m_lastActivity >= m_healthProbePeriod.count()) {
+      lck.unlock();
+      probe();
+      lck.lock();
+    }
+  }
+
+  TRC_LEAVE("thread stopped");
+}
+
+void IqrfCdcChannel::connect()
+{
+  RetryPolicy::Backoff backoff(m_connectRetry);
+  std::chrono::microseconds delay;
+
+  while (!reconnect()) {
+    if (!backoff.nextDelay(delay)) {
+      delay = m_connectRetry.getConfig().maxDelay;
+    }
+    std::unique_lock<std::mutex> lck(m_healthMtx);
+    if (m_healthCondition.wait_for(lck, delay, [&] { return !m_runHealthThread; }))
+      return;
+  }
+  flushPending();
+}
+
+void IqrfCdcChannel::flushPending()
+{
+  while (true) {
+    std::basic_string<unsigned char> message;
+    {
+      std::lock_guard<std::mutex> lck(m_pendingMtx);
+      if (m_pending.empty())
+        break;
+      message = m_pending.front();
+    }
+    // the message stays queued until sent, so sendTo() queues behind it instead of overtaking it
+    bool sent = true;
+    try {
+      send(message);
+    }
+    catch (std::exception& e) {
+      CATCH_EX("pending message dropped", std::exception, e);
+      m_pendingDropped++;
+      sent = false;
+    }
+    {
+      std::lock_guard<std::mutex> lck(m_pendingMtx);
+      m_pending.pop();
+    }
+    // the rest waits for the next connection
+    if (!sent && m_state != State::Ready)
+      break;
+  }
+}
+
+bool IqrfCdcChannel::probe()
+{
+  bool ok = false;
+  std::string error;
+  auto start = std::chrono::steady_clock::now();
+
+  m_probes++;
+  {
+    std::lock_guard<std::mutex> lck(m_cdcMtx);
+    try {
+      if (m_cdc == nullptr) {
+        error = "CDC not connected";
+      }
+      else if (m_cdc->isReceptionStopped()) {
+        error = "CDC reception stopped: " + m_cdc->getLastReceptionError();
+      }
+      else if (!m_cdc->test()) {
+        error = "CDC Test failed";
+      }
+      else {
+        ok = true;
+      }
+    }
+    catch (std::exception& e) {
+      error = e.what();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lck(m_healthMtx);
+    m_lastProbeLatency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  }
+  if (ok) {
+    m_lastActivity = nowMs();
+    setState(State::Ready, "");
+  }
+  else {
+    TRC_WAR("CDC probe failed: " << PAR(m_port) << PAR(error));
+    m_probeFailures++;
+    setState(State::NotReady, error);
+  }
+  return ok;
+}
+
+bool IqrfCdcChannel::reconnect()
+{
+#ifndef WIN
+  // the device node disappears until the USB device is enumerated again
+  if (0 != access(m_port.c_str(), F_OK)) {
+    TRC_DBG("CDC port not present: " << PAR(m_port));
+    std::lock_guard<std::mutex> lck(m_healthMtx);
+    m_lastError = "CDC port not present";
+    return false;
+  }
+#endif
+
+  TRC_INF("Connecting CDC: " << PAR(m_port));
+  bool reconnecting = false;
+  {
+    std::lock_guard<std::mutex> lck(m_cdcMtx);
+    reconnecting = m_cdc != nullptr;
+    delete m_cdc;
+    m_cdc = nullptr;
+    try {
+      m_cdc = ant_new CDCImpl(m_port.c_str());
+    }
+    catch (std::exception& e) {
+      CATCH_EX("CDC connect failed", std::exception, e);
+      std::lock_guard<std::mutex> lck(m_healthMtx);
+      m_lastError = e.what();
+      return false;
+    }
+    if (!m_receiveFromFunc.empty()) {
+      registerAsyncMsgListener();
+    }
+  }
+
+  if (probe()) {
+    if (reconnecting) {
+      m_reconnects++;
+    }
+    TRC_INF("CDC connected: " << PAR(m_port));
+    return true;
+  }
+  return false;
 }
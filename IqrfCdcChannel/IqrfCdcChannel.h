@@ -17,21 +17,125 @@
 #pragma once
 
 #include "IChannel.h"
+#include "RetryPolicy.h"
+#include "HandlerSlot.h"
 #include "CdcInterface.h"
 #include "CDCImpl.h"
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
 
 class IqrfCdcChannel : public IChannel
 {
 public:
+  /// Channel parameters
+  struct Config
+  {
+    Config()
+      :healthProbePeriod(std::chrono::milliseconds(0))
+      , asyncConnect(false)
+      , maxPendingMessages(64)
+    {
+      busyRetry.maxAttempts = 16;
+      busyRetry.deadline = std::chrono::milliseconds(400);
+      connectRetry.maxAttempts = 0;
+      connectRetry.initialDelay = std::chrono::milliseconds(50);
+      connectRetry.maxDelay = std::chrono::milliseconds(2000);
+      connectRetry.deadline = std::chrono::microseconds(0);
+    }
+
+    /// pacing of sendTo() attempts refused by DSResponse::BUSY
+    RetryPolicy::Config busyRetry;
+    /// pacing of connection attempts, continues with maxDelay period when exhausted
+    RetryPolicy::Config connectRetry;
+    /// period of background device probing, 0 (default) disables probing and reconnection
+    std::chrono::milliseconds healthProbePeriod;
+    /// constructor returns immediately and the port is opened in background
+    bool asyncConnect;
+    /// max messages queued by sendTo() until connected in asyncConnect mode
+    unsigned maxPendingMessages;
+    /// invoked when the state changes, from the background thread or from failed sendTo()
+    /// no channel lock is held, so the handler may call sendTo()
+    std::function<void(State)> stateChangeFunc;
+  };
+
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t sent;
+    uint64_t busyRetries;
+    uint64_t busyGiveUps;
+    uint64_t probes;
+    uint64_t probeFailures;
+    uint64_t reconnects;
+    uint64_t connectRetries;
+    uint64_t pendingDropped;
+  };
+
+  /// Cached result of the last device probe
+  struct Health
+  {
+    State state;
+    std::string lastError;
+    std::chrono::microseconds lastProbeLatency;
+  };
+
   IqrfCdcChannel(const std::string& portIqrf);
+  IqrfCdcChannel(const std::string& portIqrf, const Config& cfg);
   virtual ~IqrfCdcChannel();
   virtual void sendTo(const std::basic_string<unsigned char>& message) override;
   virtual void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) override;
   virtual void unregisterReceiveFromHandler() override;
+
+  /// \brief Get cached state
+  /// \details
+  /// No I/O is done, the state is maintained by background probing if enabled and by failed sends
   State getState() override;
 
+  Stats getStats() const;
+  Health getHealth() const;
+
 private:
   IqrfCdcChannel();
-  CDCImpl m_cdc;
-  ReceiveFromFunc m_receiveFromFunc;
+  void registerAsyncMsgListener();
+  void send(const std::basic_string<unsigned char>& message);
+  void healthProbe();
+  void connect();
+  void flushPending();
+  bool probe();
+  bool reconnect();
+  void setState(State state, const std::string& error);
+  void setNotReady(const std::string& error);
+
+  std::string m_port;
+  CDCImpl* m_cdc;
+  std::mutex m_cdcMtx;
+  HandlerSlot<ReceiveFromFunc> m_receiveFromFunc;
+  RetryPolicy m_busyRetry;
+  RetryPolicy m_connectRetry;
+  std::atomic<uint64_t> m_sent;
+
+  bool m_asyncConnect;
+  unsigned m_maxPendingMessages;
+  std::mutex m_pendingMtx;
+  std::queue<std::basic_string<unsigned char>> m_pending;
+  std::atomic<uint64_t> m_pendingDropped;
+  std::function<void(State)> m_stateChangeFunc;
+
+  std::atomic<State> m_state;
+  std::atomic<int64_t> m_lastActivity;
+  std::atomic<uint64_t> m_probes;
+  std::atomic<uint64_t> m_probeFailures;
+  std::atomic<uint64_t> m_reconnects;
+  mutable std::mutex m_healthMtx;
+  std::string m_lastError;
+  std::chrono::microseconds m_lastProbeLatency;
+
+  std::chrono::milliseconds m_healthProbePeriod;
+  bool m_runHealthThread;
+  std::thread m_healthThread;
+  std::condition_variable m_healthCondition;
 };
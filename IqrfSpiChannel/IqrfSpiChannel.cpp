@@ -18,6 +18,7 @@
 #include "IqrfLogging.h"
 #include "PlatformDep.h"
 #include "TaskQueue.h"
+#include "HandlerSlot.h"
 #include <string.h>
 #include <thread>
 #include <chrono>
@@ -33,6 +34,17 @@ const spi_iqrf_config_struct IqrfSpiChannel::SPI_IQRF_CFG_DEFAULT = {
   SCLK_GPIO
 };
 
+// keep the former limit of 8 attempts, the wait is cut short by listen() if the conflict was incoming data
+static RetryPolicy::Config spiBusyRetryDefault()
+{
+  RetryPolicy::Config cfg;
+  cfg.maxAttempts = 8;
+  cfg.deadline = std::chrono::microseconds(0);
+  return cfg;
+}
+
+const RetryPolicy::Config IqrfSpiChannel::SPI_BUSY_RETRY_DEFAULT = spiBusyRetryDefault();
+
 class IqrfSpiChannel::Imp
 {
 public:
@@ -40,10 +52,12 @@ public:
   
   Imp() = delete;
   
-  Imp(const spi_iqrf_config_struct& cfg)
+  Imp(const spi_iqrf_config_struct& cfg, const RetryPolicy::Config& busyRetry)
     :m_port(cfg.spiDev),
-    m_bufsize(SPI_REC_BUFFER_SIZE)
+    m_bufsize(SPI_REC_BUFFER_SIZE),
+    m_busyRetry(busyRetry)
   {
+    m_sent = 0;
     m_rx = ant_new unsigned char[m_bufsize];
     memset(m_rx, 0, m_bufsize);
 
@@ -55,8 +69,9 @@ public:
 
     m_receiveMessageQueue = new TaskQueue<std::basic_string<unsigned char>>([&](std::basic_string<unsigned char> msg) {
       // unlocked - possible to write in receiveFromFunc
-      if (m_receiveFromFunc) {
-        m_receiveFromFunc(msg);
+      HandlerSlot<ReceiveFromFunc>::Reader receiveFromFunc(m_receiveFromFunc);
+      if (receiveFromFunc) {
+        (*receiveFromFunc)(msg);
       }
       else {
         TRC_WAR("Unregistered receiveFrom() handler");
@@ -83,12 +98,12 @@ public:
 
   void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
   {
-    m_receiveFromFunc = receiveFromFunc;
+    m_receiveFromFunc.set(receiveFromFunc);
   }
 
   void unregisterReceiveFromHandler()
   {
-    m_receiveFromFunc = ReceiveFromFunc();
+    m_receiveFromFunc.reset();
   }
 
   void setCommunicationMode(_spi_iqrf_CommunicationMode mode) const
@@ -140,16 +155,18 @@ public:
 
   void sendTo(const std::basic_string<unsigned char>& message)
   {
-    const int ATTEMPTS = 8;
     static int counter = 0;
-    int attempt = 0;
+    RetryPolicy::Backoff backoff(m_busyRetry);
+    std::chrono::microseconds delay;
+    bool written = false;
     counter++;
 
     TRC_INF("Sending to IQRF SPI: " << std::endl << FORM_HEX(message.data(), message.size()));
 
-    while (attempt++ < ATTEMPTS) {
-      TRC_DBG("Trying to sent: " << counter << "." << attempt);
+    while (true) {
+      TRC_DBG("Trying to sent: " << counter << "." << backoff.attempts());
       spi_iqrf_SPIStatus status;
+      status.isDataReady = 0;
 
       std::unique_lock<std::mutex> lck(m_commMutex);
 
@@ -160,6 +177,7 @@ public:
           int retval = spi_iqrf_write((void*)message.data(), message.size());
           if (BASE_TYPES_OPER_OK == retval) {
             TRC_DBG("Success write: " << NAME_PAR(wrData, message.size()))
+            written = true;
             break;
           }
           else {
@@ -171,23 +189,38 @@ public:
         TRC_WAR("spi_iqrf_getSPIStatus() failed: " << PAR(retval));
       }
 
+      if (!backoff.nextDelay(delay)) {
+        break;
+      }
+
       // conflict with incoming data
       if (status.isDataReady) {
         TRC_WAR("Data ready postpone write: " << PAR_HEX(status.isDataReady) << PAR_HEX(status.dataReady) << PAR(m_runListenThread));
         
         // notify listen() to read immediately
         m_commCondition.notify_one();
-         
-        // wait for finished read and try write again
-        m_commCondition.wait_for(lck, std::chrono::milliseconds(100));
       }
 
+      // wait for finished read or busy SPI and try write again
+      m_commCondition.wait_for(lck, delay);
+    }
+    if (written) {
+      m_sent++;
     }
-    if (attempt > ATTEMPTS) {
-      TRC_WAR("Cannot send to SPI: message is dropped");
+    else {
+      TRC_WAR("Cannot send to SPI: message is dropped" << NAME_PAR(attempts, backoff.attempts()));
     }
   }
 
+  IqrfSpiChannel::Stats getStats() const
+  {
+    IqrfSpiChannel::Stats stats;
+    stats.sent = m_sent;
+    stats.busyRetries = m_busyRetry.getRetries();
+    stats.busyGiveUps = m_busyRetry.getGiveUps();
+    return stats;
+  }
+
 private:
   void listen()
   {
@@ -249,7 +282,7 @@ private:
     TRC_WAR("thread stopped");
   }
 
-  ReceiveFromFunc m_receiveFromFunc;
+  HandlerSlot<ReceiveFromFunc> m_receiveFromFunc;
 
   std::atomic_bool m_runListenThread;
   std::thread m_listenThread;
@@ -264,12 +297,20 @@ private:
 
   TaskQueue<std::basic_string<unsigned char>>* m_receiveMessageQueue = nullptr;
 
+  RetryPolicy m_busyRetry;
+  std::atomic<uint64_t> m_sent;
+
 };
 
 //////////////////////////////////////
 IqrfSpiChannel::IqrfSpiChannel(const spi_iqrf_config_struct& cfg)
 {
-  m_imp = ant_new Imp(cfg);
+  m_imp = ant_new Imp(cfg, SPI_BUSY_RETRY_DEFAULT);
+}
+
+IqrfSpiChannel::IqrfSpiChannel(const spi_iqrf_config_struct& cfg, const RetryPolicy::Config& busyRetry)
+{
+  m_imp = ant_new Imp(cfg, busyRetry);
 }
 
 IqrfSpiChannel::~IqrfSpiChannel()
@@ -302,6 +343,11 @@ void IqrfSpiChannel::sendTo(const std::basic_string<unsigned char>& message)
   m_imp->sendTo(message);
 }
 
+IqrfSpiChannel::Stats IqrfSpiChannel::getStats() const
+{
+  return m_imp->getStats();
+}
+
 IChannel::State IqrfSpiChannel::getState()
 {
   return m_imp->getState();
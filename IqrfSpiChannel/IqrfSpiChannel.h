@@ -18,16 +18,28 @@
 
 #include "PlatformDep.h"
 #include "IChannel.h"
+#include "RetryPolicy.h"
 #include "spi_iqrf.h"
 #include "sysfs_gpio.h"
 #include "machines_def.h"
+#include <stdint.h>
 
 class IqrfSpiChannel : public IChannel
 {
 public:
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t sent;
+    uint64_t busyRetries;
+    uint64_t busyGiveUps;
+  };
+
   static const spi_iqrf_config_struct SPI_IQRF_CFG_DEFAULT;
+  static const RetryPolicy::Config SPI_BUSY_RETRY_DEFAULT;
   IqrfSpiChannel() = delete;
   IqrfSpiChannel(const spi_iqrf_config_struct& cfg);
+  IqrfSpiChannel(const spi_iqrf_config_struct& cfg, const RetryPolicy::Config& busyRetry);
   virtual ~IqrfSpiChannel();
   void sendTo(const std::basic_string<unsigned char>& message) override;
   void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) override;
@@ -37,6 +49,8 @@ public:
   void setCommunicationMode(_spi_iqrf_CommunicationMode mode) const;
   _spi_iqrf_CommunicationMode getCommunicationMode() const;
 
+  Stats getStats() const;
+
 private:
   class Imp;
   Imp *m_imp;
@@ -16,29 +16,62 @@
 
 #include "MqChannel.h"
 #include "IqrfLogging.h"
+#include <algorithm>
+#include <random>
 
 #ifndef WIN
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <poll.h>
+#include <sys/eventfd.h>
 const int INVALID_HANDLE_VALUE = -1;
 #define QUEUE_PERMISSIONS 0644
 #define MAX_MESSAGES 32
+// max wait of the flush thread for the peer queue room before it checks the connection again
+#define FLUSH_POLL_MS 100
 
 const std::string MQ_PREFIX("/");
 
-inline MQDESCR openMqRead(const std::string name, unsigned bufsize)
+// limit for unprivileged processes from /proc/sys/fs/mqueue, 0 if unknown
+inline unsigned readMqLimit(const std::string& name)
 {
-  TRC_ENTER(PAR(name) << PAR(bufsize))
+  std::ifstream file("/proc/sys/fs/mqueue/" + name);
+  unsigned limit = 0;
+  if (!(file >> limit))
+    limit = 0;
+  return limit;
+}
+
+// CAP_SYS_RESOURCE overrides the limits, root in a container may lack it
+inline bool isMqLimitExempt()
+{
+  const unsigned long long CAP_SYS_RESOURCE_BIT = 1ULL << 24;
+  std::ifstream file("/proc/self/status");
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, 7, "CapEff:") == 0)
+      return (strtoull(line.c_str() + 7, NULL, 16) & CAP_SYS_RESOURCE_BIT) != 0;
+  }
+  return false;
+}
+
+// the queue is non-blocking, readMq() is preceded by waitMqReadable()
+inline MQDESCR openMqRead(const std::string name, unsigned maxMessages, unsigned maxMessageSize, bool recreate)
+{
+  TRC_ENTER(PAR(name) << PAR(maxMessages) << PAR(maxMessageSize) << PAR(recreate))
   mqd_t desc;
 
   struct mq_attr req_attr;
 
   req_attr.mq_flags = 0;
-  req_attr.mq_maxmsg = MAX_MESSAGES;
-  req_attr.mq_msgsize = bufsize / MAX_MESSAGES;
+  req_attr.mq_maxmsg = maxMessages;
+  req_attr.mq_msgsize = maxMessageSize;
   req_attr.mq_curmsgs = 0;
 
   TRC_DBG("required attributes" << PAR(req_attr.mq_maxmsg) << PAR(req_attr.mq_msgsize))
-  desc = mq_open(name.c_str(), O_RDONLY | O_CREAT, QUEUE_PERMISSIONS, &req_attr);
+  desc = mq_open(name.c_str(), O_RDONLY | O_CREAT | O_NONBLOCK, QUEUE_PERMISSIONS, &req_attr);
 
   if (desc > 0) {
 
@@ -48,15 +81,24 @@ inline MQDESCR openMqRead(const std::string name, unsigned bufsize)
       TRC_DBG("actual attributes: " << PAR(res) << PAR(act_attr.mq_maxmsg) << PAR(act_attr.mq_msgsize))
 
       if (act_attr.mq_maxmsg != req_attr.mq_maxmsg || act_attr.mq_msgsize != req_attr.mq_msgsize) {
-        res = mq_unlink(name.c_str());
-        if (res == 0 || errno == ENOENT) {
-          desc = mq_open(name.c_str(), O_RDONLY | O_CREAT, QUEUE_PERMISSIONS, &req_attr);
-          if (desc < 0) {
-            TRC_WAR("mq_open() after mq_unlink() failed:" << PAR(name) << PAR(desc))
-          }
+        if (!recreate) {
+          // unlinking would lose queued messages and orphan the queue opened by the peer
+          TRC_WAR("existing queue attributes differ, used as is:" << PAR(name) << PAR(act_attr.mq_maxmsg)
+            << PAR(act_attr.mq_msgsize) << PAR(act_attr.mq_curmsgs))
         }
         else {
-          TRC_WAR("mq_unlink() failed:" << PAR(name) << PAR(desc))
+          TRC_WAR("existing queue attributes differ, recreated:" << PAR(name) << PAR(act_attr.mq_curmsgs))
+          res = mq_unlink(name.c_str());
+          if (res == 0 || errno == ENOENT) {
+            mq_close(desc);
+            desc = mq_open(name.c_str(), O_RDONLY | O_CREAT | O_NONBLOCK, QUEUE_PERMISSIONS, &req_attr);
+            if (desc < 0) {
+              TRC_WAR("mq_open() after mq_unlink() failed:" << PAR(name) << PAR(desc))
+            }
+          }
+          else {
+            TRC_WAR("mq_unlink() failed:" << PAR(name) << PAR(desc))
+          }
         }
       }
     }
@@ -72,9 +114,9 @@ inline MQDESCR openMqRead(const std::string name, unsigned bufsize)
   return desc;
 }
 
-inline MQDESCR openMqWrite(const std::string name, unsigned bufsize)
+inline MQDESCR openMqWrite(const std::string name, unsigned bufsize, bool nonBlocking)
 {
-  TRC_ENTER(PAR(name))
+  TRC_ENTER(PAR(name) << PAR(nonBlocking))
 
   struct mq_attr attr;
 
@@ -84,7 +126,7 @@ inline MQDESCR openMqWrite(const std::string name, unsigned bufsize)
   attr.mq_curmsgs = 0;
 
   TRC_DBG("explicit attributes" << PAR(attr.mq_maxmsg) << PAR(attr.mq_msgsize))
-  mqd_t retval = mq_open(name.c_str(), O_WRONLY);
+  mqd_t retval = mq_open(name.c_str(), O_WRONLY | (nonBlocking ? O_NONBLOCK : 0));
 
   if (retval > 0) {
     struct mq_attr nwattr;
@@ -101,11 +143,20 @@ inline void closeMq(MQDESCR mqDescr)
   mq_close(mqDescr);
 }
 
-inline bool readMq(MQDESCR mqDescr, unsigned char* rx, unsigned long bufSize, unsigned long& numOfBytes)
+// message size of opened queue, it may differ from the requested one if the queue existed
+inline unsigned getMqMessageSize(MQDESCR mqDescr)
+{
+  struct mq_attr attr;
+  if (0 != mq_getattr(mqDescr, &attr))
+    return 0;
+  return (unsigned)attr.mq_msgsize;
+}
+
+inline bool readMq(MQDESCR mqDescr, unsigned char* rx, unsigned long bufSize, unsigned long& numOfBytes, unsigned& priority)
 {
   bool ret = true;
 
-  ssize_t numBytes = mq_receive(mqDescr, (char*)rx, bufSize, NULL);
+  ssize_t numBytes = mq_receive(mqDescr, (char*)rx, bufSize, &priority);
 
   if (numBytes <= 0) {
     ret = false;
@@ -116,30 +167,77 @@ inline bool readMq(MQDESCR mqDescr, unsigned char* rx, unsigned long bufSize, un
   return ret;
 }
 
-inline bool writeMq(MQDESCR mqDescr, const unsigned char* tx, unsigned long toWrite, unsigned long& written)
+inline bool writeMq(MQDESCR mqDescr, const unsigned char* tx, unsigned long toWrite, unsigned long& written, unsigned priority)
 {
-  TRC_ENTER(PAR(toWrite))
+  TRC_ENTER(PAR(toWrite) << PAR(priority))
 
   written = toWrite;
-  int res = mq_send(mqDescr, (const char*)tx, toWrite, 0);
+  int res = mq_send(mqDescr, (const char*)tx, toWrite, priority);
   bool retval = res == 0;
 
   TRC_LEAVE(PAR(retval))
   return retval;
 }
 
+// check if non-blocking write failed just for full queue
+inline bool isMqFull()
+{
+  return errno == EAGAIN;
+}
+
+// check if non-blocking read failed just for empty queue
+inline bool isMqEmpty()
+{
+  return errno == EAGAIN;
+}
+
+// wait for the queue event or wake-up, mqd_t is a file descriptor on Linux
+// return false if woken up, the eventfd stays signaled so it stops all waiting threads
+inline bool waitMq(MQDESCR mqDescr, short events, int wakeFd, int timeoutMs)
+{
+  pollfd pfd[2];
+  pfd[0].fd = mqDescr;
+  pfd[0].events = events;
+  pfd[0].revents = 0;
+  pfd[1].fd = wakeFd;
+  pfd[1].events = POLLIN;
+  pfd[1].revents = 0;
+  int res = poll(pfd, 2, timeoutMs);
+  if (res < 0 && errno != EINTR) {
+    TRC_WAR("poll() failed: " << NAME_PAR(GetLastError, GetLastError()));
+  }
+  return (pfd[1].revents & POLLIN) == 0;
+}
+
+inline bool waitMqReadable(MQDESCR mqDescr, int wakeFd)
+{
+  return waitMq(mqDescr, POLLIN, wakeFd, -1);
+}
+
+inline bool waitMqWritable(MQDESCR mqDescr, int wakeFd, int timeoutMs)
+{
+  return waitMq(mqDescr, POLLOUT, wakeFd, timeoutMs);
+}
+
+inline unsigned maxMqPriority()
+{
+  long prioMax = sysconf(_SC_MQ_PRIO_MAX);
+  return prioMax > 0 ? (unsigned)(prioMax - 1) : 0;
+}
+
 #else
 
 const std::string MQ_PREFIX("\\\\.\\pipe\\");
 
-inline MQDESCR openMqRead(const std::string name, unsigned bufsize)
+// pipe buffers are maxMessageSize, the rest applies to POSIX queues only
+inline MQDESCR openMqRead(const std::string name, unsigned maxMessages, unsigned maxMessageSize, bool recreate)
 {
   return CreateNamedPipe(name.c_str(), PIPE_ACCESS_INBOUND,
     PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
-    PIPE_UNLIMITED_INSTANCES, bufsize, bufsize, 0, NULL);
+    PIPE_UNLIMITED_INSTANCES, maxMessageSize, maxMessageSize, 0, NULL);
 }
 
-inline MQDESCR openMqWrite(const std::string name, unsigned bufsize)
+inline MQDESCR openMqWrite(const std::string name, unsigned bufsize, bool nonBlocking)
 {
   return CreateFile(name.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
 }
@@ -149,30 +247,154 @@ inline void closeMq(MQDESCR mqDescr)
   CloseHandle(mqDescr);
 }
 
-inline bool readMq(MQDESCR mqDescr, unsigned char* rx, unsigned long bufSize, unsigned long& numOfBytes)
+inline unsigned getMqMessageSize(MQDESCR mqDescr)
 {
+  return 0;
+}
+
+inline bool readMq(MQDESCR mqDescr, unsigned char* rx, unsigned long bufSize, unsigned long& numOfBytes, unsigned& priority)
+{
+  priority = 0;
   return ReadFile(mqDescr, rx, bufSize, &numOfBytes, NULL);
 }
 
-inline bool writeMq(MQDESCR mqDescr, const unsigned char* tx, unsigned long toWrite, unsigned long& written)
+// pipes have no priorities
+inline bool writeMq(MQDESCR mqDescr, const unsigned char* tx, unsigned long toWrite, unsigned long& written, unsigned priority)
 {
   return WriteFile(mqDescr, tx, toWrite, &written, NULL);
 }
 
+inline bool isMqFull()
+{
+  return false;
+}
+
+inline bool isMqEmpty()
+{
+  return false;
+}
+
+// pipes are read by blocking ReadFile()
+inline bool waitMqReadable(MQDESCR mqDescr, int wakeFd)
+{
+  return true;
+}
+
+inline bool waitMqWritable(MQDESCR mqDescr, int wakeFd, int timeoutMs)
+{
+  Sleep(timeoutMs);
+  return true;
+}
+
+inline unsigned maxMqPriority()
+{
+  return 0;
+}
+
 #endif
 
+// first byte of queue message with Config::fragmentation
+enum FrameType : unsigned char
+{
+  // the rest of the queue message is the whole message
+  FRAME_WHOLE = 0,
+  // FragmentHeader followed by a part of the message
+  FRAME_FRAGMENT = 1
+};
+
+// both ends are on the same host, native byte order
+struct FragmentHeader
+{
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t senderId;
+  uint32_t messageId;
+  uint32_t totalSize;
+  uint32_t offset;
+};
+
 MqChannel::MqChannel(const std::string& remoteMqName, const std::string& localMqName, unsigned bufsize, bool server)
-  :m_runListenThread(true)
+  :MqChannel(remoteMqName, localMqName, bufsize, server, Config())
+{
+}
+
+MqChannel::MqChannel(const std::string& remoteMqName, const std::string& localMqName, unsigned bufsize, bool server, const Config& cfg)
+  :m_dispatchQueue(nullptr)
+  , m_runListenThread(true)
+  , m_wakeFd(-1)
+  , m_nonBlockingSend(cfg.nonBlockingSend)
+  , m_sendBufferSize(cfg.sendBufferSize)
+  , m_sendDropPolicy(cfg.sendDropPolicy)
+  , m_runFlushThread(false)
+  , m_fragmentation(cfg.fragmentation)
+  , m_maxReassemblySize(cfg.maxReassemblySize)
+  , m_reassemblyTimeout(cfg.reassemblyTimeout)
+  , m_reassemblyBytes(0)
   , m_localMqHandle(INVALID_HANDLE_VALUE)
   , m_remoteMqHandle(INVALID_HANDLE_VALUE)
   , m_localMqName(localMqName)
   , m_remoteMqName(remoteMqName)
   , m_bufsize(bufsize)
+  , m_maxMessages(cfg.maxMessages)
+  , m_maxMessageSize(cfg.maxMessageSize)
+  , m_recreateQueue(cfg.recreateQueue)
   , m_server(server)
 {
-  TRC_ENTER(PAR(remoteMqName) << PAR(localMqName) << PAR(bufsize));
+  TRC_ENTER(PAR(remoteMqName) << PAR(localMqName) << PAR(bufsize) << PAR(cfg.maxMessages) << PAR(cfg.maxMessageSize));
+
+#ifndef WIN
+  // mq_open() would fail with EINVAL in the listening thread, explicit values are checked here
+  unsigned msgMax = isMqLimitExempt() ? 0 : readMqLimit("msg_max");
+  unsigned msgsizeMax = isMqLimitExempt() ? 0 : readMqLimit("msgsize_max");
+
+  if (m_maxMessages == 0) {
+    m_maxMessages = MAX_MESSAGES;
+    if (msgMax > 0 && m_maxMessages > msgMax)
+      m_maxMessages = msgMax;
+  }
+  else if (msgMax > 0 && m_maxMessages > msgMax) {
+    THROW_EX(MqChannelException, "maxMessages exceeds /proc/sys/fs/mqueue/msg_max: " << PAR(m_maxMessages) << PAR(msgMax));
+  }
+
+  if (m_maxMessageSize == 0) {
+    m_maxMessageSize = m_bufsize / MAX_MESSAGES;
+    if (msgsizeMax > 0 && m_maxMessageSize > msgsizeMax)
+      m_maxMessageSize = msgsizeMax;
+  }
+  else if (msgsizeMax > 0 && m_maxMessageSize > msgsizeMax) {
+    THROW_EX(MqChannelException, "maxMessageSize exceeds /proc/sys/fs/mqueue/msgsize_max: " << PAR(m_maxMessageSize) << PAR(msgsizeMax));
+  }
+
+  if (m_maxMessageSize == 0) {
+    THROW_EX(MqChannelException, "zero message size: " << PAR(bufsize));
+  }
+  // mq_receive() requires the buffer for the max message
+  if (m_bufsize < m_maxMessageSize)
+    m_bufsize = m_maxMessageSize;
+#else
+  m_maxMessageSize = m_bufsize;
+  m_nonBlockingSend = false;
+#endif
+
+#ifndef WIN
+  // created before anything that would leak if it fails
+  m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (m_wakeFd < 0) {
+    THROW_EX(MqChannelException, "eventfd() failed: " << NAME_PAR(GetLastError, GetLastError()));
+  }
+#endif
 
   m_connected = false;
+  m_received = 0;
+  m_sent = 0;
+  m_sendDeferred = 0;
+  m_sendDropped = 0;
+  m_senderId = std::random_device()();
+  m_fragmentedId = 0;
+  m_remoteMsgSize = 0;
+  m_fragmentsSent = 0;
+  m_fragmentsReceived = 0;
+  m_reassemblyDropped = 0;
   m_rx = ant_new unsigned char[m_bufsize];
   memset(m_rx, 0, m_bufsize);
 
@@ -181,22 +403,56 @@ MqChannel::MqChannel(const std::string& remoteMqName, const std::string& localMq
 
   TRC_INF(PAR(m_localMqName) << PAR(m_remoteMqName));
 
+  if (cfg.dispatchQueueSize > 0) {
+    m_dispatchQueue = ant_new TaskQueue<DispatchItem>([this](DispatchItem&& item) {
+      dispatch(item.mMessage, item.mPriority);
+    }, cfg.dispatchQueueSize, cfg.dispatchDropPolicy);
+  }
+
+  if (m_nonBlockingSend) {
+    m_runFlushThread = true;
+    m_flushThread = std::thread(&MqChannel::flush, this);
+  }
+
   m_listenThread = std::thread(&MqChannel::listen, this);
   TRC_LEAVE("");
 }
 
 MqChannel::~MqChannel()
 {
-  TRC_DBG("joining Mq listening thread");
   m_runListenThread = false;
 #ifndef WIN
-  //seem the only way to stop the thread here
-  pthread_cancel(m_listenThread.native_handle());
+  // stops the listening thread waiting for a message and the flush thread waiting for the queue room
+  uint64_t wake = 1;
+  if (write(m_wakeFd, &wake, sizeof(wake)) < 0) {
+    TRC_WAR("eventfd write failed: " << NAME_PAR(GetLastError, GetLastError()));
+  }
+#endif
+
+  if (m_flushThread.joinable()) {
+    TRC_DBG("joining Mq flush thread");
+    {
+      std::lock_guard<std::mutex> lck(m_sendMtx);
+      m_runFlushThread = false;
+      if (!m_sendBuffer.empty()) {
+        TRC_WAR("unsent messages dropped: " << NAME_PAR(count, m_sendBuffer.size()));
+      }
+    }
+    m_sendCv.notify_all();
+    m_flushThread.join();
+    TRC_DBG("flush thread joined");
+  }
+
+  TRC_DBG("joining Mq listening thread");
+#ifndef WIN
+  if (m_listenThread.joinable())
+    m_listenThread.join();
   closeMq(m_remoteMqHandle);
   closeMq(m_localMqHandle);
+  close(m_wakeFd);
 #else
   // Open write channel to client just to unblock ConnectNamedPipe() if listener waits there
-  MQDESCR mqHandle = openMqWrite(m_localMqName, m_bufsize);
+  MQDESCR mqHandle = openMqWrite(m_localMqName, m_bufsize, false);
   closeMq(m_remoteMqHandle);
   closeMq(m_localMqHandle);
 #endif
@@ -205,6 +461,8 @@ MqChannel::~MqChannel()
     m_listenThread.join();
   TRC_DBG("listening thread joined");
 
+  // the handler may still be running from the dispatch thread
+  delete m_dispatchQueue;
   delete[] m_rx;
 }
 
@@ -218,12 +476,20 @@ void MqChannel::listen()
       unsigned long cbBytesRead = 0;
       bool fSuccess(false);
 
-      m_localMqHandle = openMqRead(m_localMqName, m_bufsize);
+      m_localMqHandle = openMqRead(m_localMqName, m_maxMessages, m_maxMessageSize, m_recreateQueue);
       if (m_localMqHandle == INVALID_HANDLE_VALUE) {
         THROW_EX(MqChannelException, "openMqRead() failed: " << NAME_PAR(GetLastError, GetLastError()));
       }
       TRC_INF("openMqRead() opened: " << PAR(m_localMqName));
 
+      // existing queue is used with its own attributes
+      unsigned msgSize = getMqMessageSize(m_localMqHandle);
+      if (msgSize > m_bufsize) {
+        delete[] m_rx;
+        m_bufsize = msgSize;
+        m_rx = ant_new unsigned char[m_bufsize];
+      }
+
 #ifdef WIN
       // Wait to connect from cient
       m_state = State::Ready;
@@ -238,7 +504,12 @@ void MqChannel::listen()
       while (m_runListenThread) {
     	m_state = State::Ready;
         cbBytesRead = 0;
-        fSuccess = readMq(m_localMqHandle, m_rx, m_bufsize, cbBytesRead);
+        unsigned priority = 0;
+        if (!waitMqReadable(m_localMqHandle, m_wakeFd))
+          break;
+        fSuccess = readMq(m_localMqHandle, m_rx, m_bufsize, cbBytesRead, priority);
+        if (!fSuccess && isMqEmpty())
+          continue;
         if (!fSuccess || cbBytesRead == 0) {
           if (m_server) { // listen again
             closeMq(m_localMqHandle);
@@ -253,12 +524,28 @@ void MqChannel::listen()
           }
         }
 
-        if (m_receiveFromFunc) {
-          std::basic_string<unsigned char> message(m_rx, cbBytesRead);
-          m_receiveFromFunc(message);
+        m_received++;
+        std::basic_string<unsigned char> message;
+        if (m_fragmentation) {
+          if (!reassemble(m_rx, cbBytesRead, message))
+            continue;
+        }
+        else {
+          message.assign(m_rx, cbBytesRead);
+        }
+        if (m_dispatchQueue) {
+          // the handler can't stall reading, the queue drops if it doesn't keep up
+          DispatchItem item;
+          item.mMessage = std::move(message);
+          item.mPriority = priority;
+          // prioritized messages overtake bulk data waiting in the queue, the handler still runs in one thread
+          if (priority > 0)
+            m_dispatchQueue->pushUrgent(std::move(item));
+          else
+            m_dispatchQueue->pushToQueue(std::move(item));
         }
         else {
-          TRC_WAR("Unregistered receiveFrom() handler");
+          dispatch(message, priority);
         }
       }
     }
@@ -275,6 +562,23 @@ void MqChannel::listen()
   TRC_LEAVE("thread stopped");
 }
 
+void MqChannel::dispatch(const std::basic_string<unsigned char>& message, unsigned priority)
+{
+  HandlerSlot<ReceivePriorityFunc>::Reader receivePriorityFunc(m_receivePriorityFunc);
+  if (receivePriorityFunc) {
+    (*receivePriorityFunc)(message, priority);
+    return;
+  }
+
+  HandlerSlot<ReceiveFromFunc>::Reader receiveFromFunc(m_receiveFromFunc);
+  if (receiveFromFunc) {
+    (*receiveFromFunc)(message);
+  }
+  else {
+    TRC_WAR("Unregistered receiveFrom() handler");
+  }
+}
+
 void MqChannel::connect()
 {
   if (!m_connected) {
@@ -284,13 +588,15 @@ void MqChannel::connect()
     closeMq(m_remoteMqHandle);
 
     // Open write channel to client
-    m_remoteMqHandle = openMqWrite(m_remoteMqName, m_bufsize);
+    m_remoteMqHandle = openMqWrite(m_remoteMqName, m_bufsize, m_nonBlockingSend);
     if (m_remoteMqHandle == INVALID_HANDLE_VALUE) {
       TRC_WAR("openMqWrite() failed: " << NAME_PAR(GetLastError, GetLastError()));
       //if (GetLastError() != ERROR_PIPE_BUSY)
+      m_remoteMsgSize = 0;
     }
     else {
       TRC_INF("openMqWrite() opened: " << PAR(m_remoteMqName));
+      m_remoteMsgSize = getMqMessageSize(m_remoteMqHandle);
       m_connected = true;
     }
   }
@@ -298,33 +604,385 @@ void MqChannel::connect()
 
 void MqChannel::sendTo(const std::basic_string<unsigned char>& message)
 {
-  TRC_INF("Send to MQ: " << std::endl << FORM_HEX(message.data(), message.size()));
+  sendTo(message, 0);
+}
+
+void MqChannel::sendTo(const std::basic_string<unsigned char>& message, unsigned priority)
+{
+  TRC_INF("Send to MQ: " << PAR(priority) << std::endl << FORM_HEX(message.data(), message.size()));
 
-  unsigned long toWrite = message.size();
+  if (priority > getMaxPriority()) {
+    THROW_EX(MqChannelException, "priority out of range: " << PAR(priority) << NAME_PAR(maxPriority, getMaxPriority()));
+  }
+
+  if (m_fragmentation) {
+    sendFragmented(message, priority);
+    return;
+  }
+
+  sendFrame(message, priority);
+}
+
+void MqChannel::sendFrame(const std::basic_string<unsigned char>& frame, unsigned priority)
+{
+  if (m_nonBlockingSend) {
+    sendNonBlocking(&frame, 1, priority);
+    return;
+  }
+
+  unsigned long toWrite = frame.size();
   unsigned long written = 0;
   bool reconnect = false;
   bool fSuccess;
 
   connect(); //open write channel if not connected yet
 
-  fSuccess = writeMq(m_remoteMqHandle, message.data(), toWrite, written);
+  fSuccess = writeMq(m_remoteMqHandle, frame.data(), toWrite, written, priority);
   if (!fSuccess || toWrite != written) {
     TRC_WAR("writeMq() failed: " << NAME_PAR(GetLastError, GetLastError()));
     m_connected = false;
   }
+  else {
+    m_sent++;
+  }
+}
+
+void MqChannel::sendFragmented(const std::basic_string<unsigned char>& message, unsigned priority)
+{
+  if (m_remoteMsgSize == 0)
+    connect();
+  unsigned msgSize = m_remoteMsgSize;
+
+  // pipe or the peer queue not open yet send the whole message
+  if (msgSize == 0 || message.size() < msgSize) {
+    std::basic_string<unsigned char> frame;
+    frame.reserve(message.size() + 1);
+    frame.push_back(FRAME_WHOLE);
+    frame.append(message);
+    sendFrame(frame, priority);
+    return;
+  }
+
+  std::vector<std::basic_string<unsigned char>> frames;
+  splitFragments(message, msgSize, frames);
+
+  if (!m_nonBlockingSend) {
+    for (const auto& frame : frames) {
+      sendFrame(frame, priority);
+      m_fragmentsSent++;
+    }
+    return;
+  }
+
+  // fragments are buffered together, they never make room for each other
+  if (frames.size() > m_sendBufferSize) {
+    THROW_EX(MqChannelException, "message has more fragments than the send buffer takes: "
+      << NAME_PAR(fragments, frames.size()) << PAR(m_sendBufferSize));
+  }
+  m_fragmentsSent += frames.size();
+  sendNonBlocking(frames.data(), frames.size(), priority);
+}
+
+void MqChannel::splitFragments(const std::basic_string<unsigned char>& message, unsigned msgSize,
+  std::vector<std::basic_string<unsigned char>>& frames)
+{
+  if (msgSize <= sizeof(FragmentHeader)) {
+    THROW_EX(MqChannelException, "peer queue message size too small for fragments: " << PAR(msgSize));
+  }
+
+  FragmentHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.type = FRAME_FRAGMENT;
+  hdr.senderId = m_senderId;
+  hdr.messageId = m_fragmentedId++;
+  hdr.totalSize = (uint32_t)message.size();
+
+  // fragments of one message have the same priority so the queue keeps their order
+  size_t chunk = msgSize - sizeof(FragmentHeader);
+  frames.reserve((message.size() + chunk - 1) / chunk);
+  for (size_t offset = 0; offset < message.size(); offset += chunk) {
+    hdr.offset = (uint32_t)offset;
+    std::basic_string<unsigned char> frame((const unsigned char*)&hdr, sizeof(hdr));
+    frame.append(message, offset, chunk);
+    frames.push_back(std::move(frame));
+  }
+}
+
+bool MqChannel::needsSplit(const std::basic_string<unsigned char>& frame) const
+{
+  unsigned msgSize = m_remoteMsgSize;
+  return m_fragmentation && msgSize > 0 && frame.size() > msgSize && !frame.empty() && frame[0] == FRAME_WHOLE;
+}
+
+// called with m_sendMtx locked
+void MqChannel::splitBufferedFront()
+{
+  SendItem item = std::move(m_sendBuffer.front());
+  m_sendBuffer.pop_front();
+
+  std::vector<std::basic_string<unsigned char>> frames;
+  try {
+    splitFragments(item.mMessage.substr(1), m_remoteMsgSize, frames);
+  }
+  catch (std::exception& e) {
+    CATCH_EX("buffered message dropped", std::exception, e);
+    m_sendDropped++;
+    return;
+  }
+
+  // the fragments take the place of the whole frame, the buffer may exceed its size by them
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    SendItem fragment;
+    fragment.mMessage = std::move(*it);
+    fragment.mPriority = item.mPriority;
+    m_sendBuffer.push_front(std::move(fragment));
+  }
+  m_fragmentsSent += frames.size();
+}
+
+bool MqChannel::reassemble(const unsigned char* frame, unsigned long size, std::basic_string<unsigned char>& message)
+{
+  if (size >= 1 && frame[0] == FRAME_WHOLE) {
+    message.assign(frame + 1, size - 1);
+    return true;
+  }
+
+  if (size < sizeof(FragmentHeader) || frame[0] != FRAME_FRAGMENT) {
+    TRC_WAR("unknown frame dropped, is fragmentation enabled by the peer? " << PAR(size));
+    return false;
+  }
+
+  FragmentHeader hdr;
+  memcpy(&hdr, frame, sizeof(hdr));
+  const unsigned char* data = frame + sizeof(hdr);
+  size_t len = size - sizeof(hdr);
+  uint64_t key = ((uint64_t)hdr.senderId << 32) | hdr.messageId;
+  auto now = std::chrono::steady_clock::now();
+  m_fragmentsReceived++;
+
+  auto drop = [&](std::map<uint64_t, Reassembly>::iterator it) {
+    m_reassemblyBytes -= it->second.mTotalSize;
+    m_reassemblyDropped++;
+    return m_reassembly.erase(it);
+  };
+
+  auto found = m_reassembly.find(key);
+  if (found == m_reassembly.end()) {
+    if (hdr.offset != 0) {
+      // the message was already dropped
+      return false;
+    }
+    if (hdr.totalSize > m_maxReassemblySize) {
+      TRC_WAR("fragmented message too long, dropped: " << PAR(hdr.totalSize) << PAR(m_maxReassemblySize));
+      m_reassemblyDropped++;
+      return false;
+    }
+
+    // make room, expired messages first then the oldest ones
+    for (auto it = m_reassembly.begin(); it != m_reassembly.end();) {
+      if (now - it->second.mStarted > m_reassemblyTimeout) {
+        TRC_WAR("fragmented message timed out, dropped: " << NAME_PAR(received, it->second.mMessage.size())
+          << NAME_PAR(totalSize, it->second.mTotalSize));
+        it = drop(it);
+      }
+      else {
+        ++it;
+      }
+    }
+    while (m_reassemblyBytes + hdr.totalSize > m_maxReassemblySize) {
+      auto oldest = std::min_element(m_reassembly.begin(), m_reassembly.end(),
+        [](const std::pair<const uint64_t, Reassembly>& a, const std::pair<const uint64_t, Reassembly>& b) {
+        return a.second.mStarted < b.second.mStarted; });
+      TRC_WAR("reassembly memory full, oldest fragmented message dropped: " << PAR(m_reassemblyBytes));
+      drop(oldest);
+    }
+
+    found = m_reassembly.insert(std::make_pair(key, Reassembly())).first;
+    found->second.mTotalSize = hdr.totalSize;
+    found->second.mStarted = now;
+    found->second.mMessage.reserve(hdr.totalSize);
+    m_reassemblyBytes += hdr.totalSize;
+  }
+
+  Reassembly& reassembly = found->second;
+  if (hdr.offset != reassembly.mMessage.size() || hdr.totalSize != reassembly.mTotalSize || len > hdr.totalSize - hdr.offset) {
+    TRC_WAR("fragment lost, message dropped: " << PAR(hdr.offset) << NAME_PAR(received, reassembly.mMessage.size()));
+    drop(found);
+    return false;
+  }
+
+  reassembly.mMessage.append(data, len);
+  if (reassembly.mMessage.size() < reassembly.mTotalSize)
+    return false;
+
+  message.swap(reassembly.mMessage);
+  m_reassemblyBytes -= reassembly.mTotalSize;
+  m_reassembly.erase(found);
+  return true;
+}
+
+void MqChannel::sendNonBlocking(const std::basic_string<unsigned char>* frames, size_t count, unsigned priority)
+{
+  std::unique_lock<std::mutex> lck(m_sendMtx);
+
+  // buffered messages of the same or higher priority go first to keep the order
+  size_t written = 0;
+  if (m_sendBuffer.empty() || priority > m_sendBuffer.front().mPriority) {
+    connect();
+    // the peer queue may not exist yet, the frames wait for the flush thread to connect
+    // a whole frame sent before the peer message size was known waits to be split by the flush thread
+    while (m_connected && written < count && !needsSplit(frames[written])) {
+      unsigned long len = 0;
+      if (writeMq(m_remoteMqHandle, frames[written].data(), frames[written].size(), len, priority)) {
+        m_sent++;
+        written++;
+        continue;
+      }
+      if (!isMqFull()) {
+        m_connected = false;
+        m_sendDropped += count - written;
+        THROW_EX(MqChannelException, "writeMq() failed, message dropped: " << NAME_PAR(GetLastError, GetLastError()));
+      }
+      break;
+    }
+  }
+  if (written == count)
+    return;
+
+  size_t rest = count - written;
+  m_sendDeferred += rest;
+  if (m_sendBuffer.size() + rest > m_sendBufferSize) {
+    // the oldest messages of the lowest priority are dropped unless the new one has even lower priority
+    size_t droppable = 0;
+    if (m_sendDropPolicy == QueueDropPolicy::DropOldest) {
+      for (auto it = m_sendBuffer.rbegin(); it != m_sendBuffer.rend() && it->mPriority <= priority; ++it)
+        droppable++;
+    }
+    if (m_sendBuffer.size() - droppable + rest > m_sendBufferSize) {
+      m_sendDropped += rest;
+      TRC_WAR("send buffer full, message dropped: " << PAR(m_remoteMqName));
+      return;
+    }
+    while (m_sendBuffer.size() + rest > m_sendBufferSize) {
+      auto oldest = m_sendBuffer.end() - 1;
+      while (oldest != m_sendBuffer.begin() && (oldest - 1)->mPriority == oldest->mPriority)
+        --oldest;
+      m_sendBuffer.erase(oldest);
+      m_sendDropped++;
+    }
+    TRC_WAR("send buffer full, oldest messages dropped: " << PAR(m_remoteMqName));
+  }
+
+  // ordered by priority, equal priorities in order of sending
+  auto pos = m_sendBuffer.end();
+  while (pos != m_sendBuffer.begin() && (pos - 1)->mPriority < priority)
+    --pos;
+  for (size_t i = written; i < count; i++) {
+    SendItem item;
+    item.mMessage = frames[i];
+    item.mPriority = priority;
+    pos = m_sendBuffer.insert(pos, std::move(item)) + 1;
+  }
+  lck.unlock();
+  m_sendCv.notify_one();
+}
+
+void MqChannel::flush()
+{
+  TRC_ENTER("thread starts");
+
+  std::unique_lock<std::mutex> lck(m_sendMtx);
+  while (m_runFlushThread) {
+    if (m_sendBuffer.empty()) {
+      m_sendCv.wait(lck, [&] { return !m_sendBuffer.empty() || !m_runFlushThread; });
+      continue;
+    }
+
+    // send what the peer queue takes
+    connect();
+    while (m_connected && !m_sendBuffer.empty()) {
+      if (needsSplit(m_sendBuffer.front().mMessage)) {
+        splitBufferedFront();
+        continue;
+      }
+      const SendItem& item = m_sendBuffer.front();
+      unsigned long written = 0;
+      if (!writeMq(m_remoteMqHandle, item.mMessage.data(), item.mMessage.size(), written, item.mPriority)) {
+        if (!isMqFull()) {
+          TRC_WAR("writeMq() failed, message dropped: " << NAME_PAR(GetLastError, GetLastError()));
+          m_connected = false;
+          m_sendBuffer.pop_front();
+          m_sendDropped++;
+        }
+        break;
+      }
+      m_sendBuffer.pop_front();
+      m_sent++;
+    }
+
+    if (m_sendBuffer.empty())
+      continue;
+
+    if (m_connected) {
+      // non-blocking sends reconnect under m_sendMtx only, the descriptor can't be closed by another send meanwhile
+      MQDESCR handle = m_remoteMqHandle;
+      lck.unlock();
+      waitMqWritable(handle, m_wakeFd, FLUSH_POLL_MS);
+      lck.lock();
+    }
+    else {
+      m_sendCv.wait_for(lck, std::chrono::milliseconds(FLUSH_POLL_MS));
+    }
+  }
+
+  TRC_LEAVE("thread stopped");
 }
 
 void MqChannel::registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
 {
-  m_receiveFromFunc = receiveFromFunc;
+  m_receiveFromFunc.set(receiveFromFunc);
 }
 
 void MqChannel::unregisterReceiveFromHandler()
 {
-  m_receiveFromFunc = ReceiveFromFunc();
+  m_receiveFromFunc.reset();
+}
+
+void MqChannel::registerReceivePriorityHandler(ReceivePriorityFunc receivePriorityFunc)
+{
+  m_receivePriorityFunc.set(receivePriorityFunc);
+}
+
+void MqChannel::unregisterReceivePriorityHandler()
+{
+  m_receivePriorityFunc.reset();
+}
+
+unsigned MqChannel::getMaxPriority()
+{
+  return maxMqPriority();
 }
 
 IChannel::State MqChannel::getState()
 {
   return m_state;
 }
+
+MqChannel::Stats MqChannel::getStats() const
+{
+  Stats stats;
+  stats.received = m_received;
+  stats.sent = m_sent;
+  stats.fragmentsSent = m_fragmentsSent;
+  stats.fragmentsReceived = m_fragmentsReceived;
+  stats.reassemblyDropped = m_reassemblyDropped;
+  stats.sendDeferred = m_sendDeferred;
+  stats.sendDropped = m_sendDropped;
+  {
+    std::lock_guard<std::mutex> lck(m_sendMtx);
+    stats.sendBuffered = m_sendBuffer.size();
+  }
+  stats.dispatchDropped = m_dispatchQueue ? m_dispatchQueue->getDropped() : 0;
+  stats.dispatchQueued = m_dispatchQueue ? m_dispatchQueue->size() : 0;
+  return stats;
+}
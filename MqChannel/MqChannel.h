@@ -19,10 +19,17 @@
 #include "PlatformDep.h"
 
 #include "IChannel.h"
+#include "TaskQueue.h"
+#include "HandlerSlot.h"
 #include <string>
 #include <exception>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <vector>
+#include <chrono>
 #include <atomic>
 
 #ifdef WIN
@@ -40,7 +47,88 @@ typedef std::basic_string<unsigned char> ustring;
 class MqChannel: public IChannel
 {
 public:
+  /// Channel parameters
+  struct Config
+  {
+    Config()
+      :maxMessages(0)
+      , maxMessageSize(0)
+      , recreateQueue(false)
+      , nonBlockingSend(false)
+      , sendBufferSize(256)
+      , sendDropPolicy(QueueDropPolicy::DropOldest)
+      , fragmentation(false)
+      , maxReassemblySize(1024 * 1024)
+      , reassemblyTimeout(5000)
+      , dispatchQueueSize(0)
+      , dispatchDropPolicy(QueueDropPolicy::DropOldest)
+    {}
+
+    /// depth of the local queue (mq_maxmsg), 0 is 32 lowered to /proc/sys/fs/mqueue/msg_max (Linux only)
+    unsigned maxMessages;
+    /// max message size of the local queue (mq_msgsize), 0 is bufsize / 32 lowered to
+    /// /proc/sys/fs/mqueue/msgsize_max (Linux only)
+    unsigned maxMessageSize;
+    /// unlink and create again existing queue with different attributes, messages in the queue are lost
+    /// and a peer having the old queue open keeps writing to it, the queue is used as is otherwise
+    bool recreateQueue;
+
+    /// sendTo() doesn't wait if the peer queue is full or doesn't exist yet (Linux only), the message waits
+    /// in a local buffer sent by a flush thread when the queue has room, buffered messages are ordered
+    /// by priority and keep their order within the same priority
+    /// sendTo() throws if the write fails for another reason
+    bool nonBlockingSend;
+    /// max messages in the local send buffer, Config::nonBlockingSend only
+    unsigned sendBufferSize;
+    /// what is dropped if the peer doesn't keep up and the send buffer is full
+    /// DropOldest drops the oldest message of the lowest priority
+    QueueDropPolicy sendDropPolicy;
+
+    /// split messages bigger than the peer queue message size into fragments and reassemble received ones
+    /// both ends must enable it, every queue message then starts with a frame header
+    /// with Config::nonBlockingSend sendTo() throws if the message has more fragments than Config::sendBufferSize
+    bool fragmentation;
+    /// max bytes of all partially received messages, the oldest are dropped to make room
+    unsigned maxReassemblySize;
+    /// partially received messages are dropped after this time
+    std::chrono::milliseconds reassemblyTimeout;
+
+    /// max messages waiting for the handler in a dispatch thread, 0 invokes the handler from the listen thread
+    /// reading then never waits for the handler so the peer isn't blocked by full queue
+    /// messages with priority above 0 overtake queued messages of priority 0
+    unsigned dispatchQueueSize;
+    /// what is dropped if the handler doesn't keep up and the dispatch queue is full
+    QueueDropPolicy dispatchDropPolicy;
+  };
+
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t received;
+    uint64_t sent;
+    /// messages that found the peer queue full and went through the send buffer, Config::nonBlockingSend only
+    uint64_t sendDeferred;
+    /// messages dropped for full send buffer or send error, Config::nonBlockingSend only
+    uint64_t sendDropped;
+    /// messages waiting in send buffer
+    uint64_t sendBuffered;
+    /// fragments of split messages, Config::fragmentation only
+    uint64_t fragmentsSent;
+    uint64_t fragmentsReceived;
+    /// partially received messages dropped for lost fragment, timeout or reassembly memory limit
+    uint64_t reassemblyDropped;
+    /// messages dropped for full dispatch queue, Config::dispatchQueueSize only
+    uint64_t dispatchDropped;
+    /// messages waiting in dispatch queue
+    uint64_t dispatchQueued;
+  };
+
+  // receive data handler with the message priority
+  typedef std::function<int(const std::basic_string<unsigned char>&, unsigned priority)> ReceivePriorityFunc;
+
   MqChannel(const std::string& remoteMqName, const std::string& localMqName, unsigned bufsize, bool server = false);
+  /// \throw MqChannelException if explicit Config::maxMessages or Config::maxMessageSize exceeds system limits
+  MqChannel(const std::string& remoteMqName, const std::string& localMqName, unsigned bufsize, bool server, const Config& cfg);
   virtual ~MqChannel();
 
   void sendTo(const std::basic_string<unsigned char>& message) override;
@@ -48,17 +136,105 @@ public:
   void unregisterReceiveFromHandler() override;
   State getState() override;
 
+  /// \brief Send with priority
+  /// \details
+  /// Messages of higher priority are received first, sendTo() without priority sends with 0.
+  /// Priority is ignored by Windows pipes.
+  /// \param [in] priority 0 to getMaxPriority()
+  /// \throw MqChannelException if the priority is out of range
+  void sendTo(const std::basic_string<unsigned char>& message, unsigned priority);
+
+  /// \brief Register handler getting the priority of each message
+  /// \details
+  /// The handler takes precedence over the handler registered by registerReceiveFromHandler().
+  void registerReceivePriorityHandler(ReceivePriorityFunc receivePriorityFunc);
+  void unregisterReceivePriorityHandler();
+
+  /// \brief Get the highest message priority supported by the system
+  static unsigned getMaxPriority();
+
+  Stats getStats() const;
+
 private:
   MqChannel();
-  ReceiveFromFunc m_receiveFromFunc;
+  // message waiting for dispatch thread
+  struct DispatchItem
+  {
+    std::basic_string<unsigned char> mMessage;
+    unsigned mPriority;
+  };
+
+  // message waiting in send buffer
+  struct SendItem
+  {
+    std::basic_string<unsigned char> mMessage;
+    unsigned mPriority;
+  };
+
+  // message being reassembled from fragments
+  struct Reassembly
+  {
+    std::basic_string<unsigned char> mMessage;
+    uint32_t mTotalSize;
+    std::chrono::steady_clock::time_point mStarted;
+  };
+
+  void dispatch(const std::basic_string<unsigned char>& message, unsigned priority);
+  void sendFragmented(const std::basic_string<unsigned char>& message, unsigned priority);
+  // throws MqChannelException if the peer message size leaves no room for data
+  void splitFragments(const std::basic_string<unsigned char>& message, unsigned msgSize,
+    std::vector<std::basic_string<unsigned char>>& frames);
+  // the whole frame is longer than the peer message size, it was buffered before the size was known
+  bool needsSplit(const std::basic_string<unsigned char>& frame) const;
+  void splitBufferedFront();
+  // return true if the frame completes a message
+  bool reassemble(const unsigned char* frame, unsigned long size, std::basic_string<unsigned char>& message);
+  void sendFrame(const std::basic_string<unsigned char>& frame, unsigned priority);
+  // frames of one message are buffered together or dropped together
+  void sendNonBlocking(const std::basic_string<unsigned char>* frames, size_t count, unsigned priority);
+  void flush();
+  HandlerSlot<ReceiveFromFunc> m_receiveFromFunc;
+  HandlerSlot<ReceivePriorityFunc> m_receivePriorityFunc;
+  TaskQueue<DispatchItem>* m_dispatchQueue;
+  std::atomic<uint64_t> m_received;
 
   std::atomic_bool m_connected;
-  bool m_runListenThread;
+  std::atomic_bool m_runListenThread;
+  // eventfd signaled by the destructor (Linux only)
+  int m_wakeFd;
   std::thread m_listenThread;
   void listen();
   void connect();
   std::mutex m_connectMtx;
 
+  bool m_nonBlockingSend;
+  unsigned m_sendBufferSize;
+  QueueDropPolicy m_sendDropPolicy;
+  // guards send buffer and the order of non-blocking sends
+  mutable std::mutex m_sendMtx;
+  std::condition_variable m_sendCv;
+  std::deque<SendItem> m_sendBuffer;
+  bool m_runFlushThread;
+  std::thread m_flushThread;
+  std::atomic<uint64_t> m_sent;
+  std::atomic<uint64_t> m_sendDeferred;
+  std::atomic<uint64_t> m_sendDropped;
+
+  bool m_fragmentation;
+  unsigned m_maxReassemblySize;
+  std::chrono::milliseconds m_reassemblyTimeout;
+  // identifies fragments of this channel in a queue shared by more senders
+  uint32_t m_senderId;
+  std::atomic<uint32_t> m_fragmentedId;
+  // message size of the peer queue, 0 if unknown
+  std::atomic<unsigned> m_remoteMsgSize;
+  // keyed by sender and message ID, accessed by listening thread only
+  std::map<uint64_t, Reassembly> m_reassembly;
+  size_t m_reassemblyBytes;
+  std::atomic<uint64_t> m_fragmentsSent;
+  std::atomic<uint64_t> m_fragmentsReceived;
+  std::atomic<uint64_t> m_reassemblyDropped;
+
   MQDESCR m_localMqHandle;
   MQDESCR m_remoteMqHandle;
   std::string m_localMqName;
@@ -66,6 +242,9 @@ private:
 
   unsigned char* m_rx;
   unsigned m_bufsize;
+  unsigned m_maxMessages;
+  unsigned m_maxMessageSize;
+  bool m_recreateQueue;
   bool m_server;
   State m_state = State::NotReady;
 
@@ -0,0 +1,425 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ShmChannel.h"
+#include "IqrfLogging.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <time.h>
+
+#define SHM_PERMISSIONS 0660
+
+const std::string SHM_PREFIX("/");
+const uint32_t SHM_MAGIC = 0x48535149; // "IQSH"
+const uint32_t SHM_VERSION = 2;
+const unsigned MIN_RING_SIZE = 4096;
+const unsigned MAX_RING_SIZE = 1u << 30;
+
+// futex words are shared between processes
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "std::atomic<uint32_t> can't be used as futex");
+
+/// one direction, indexes run freely, position in data is index & mask
+/// producer and consumer fields are on separate cache lines
+struct ShmRing
+{
+  /// written by producer, end of published messages
+  alignas(64) std::atomic<uint32_t> head;
+  /// written by consumer, end of consumed messages
+  alignas(64) std::atomic<uint32_t> tail;
+  /// 1 if consumer sleeps or is going to sleep on empty ring
+  alignas(64) std::atomic<uint32_t> readerWaiting;
+  /// 1 if producer sleeps or is going to sleep on full ring
+  alignas(64) std::atomic<uint32_t> writerWaiting;
+};
+
+/// segment header followed by data of rings[0] (server to client) and rings[1] (client to server)
+struct ShmSegment
+{
+  /// set by server when the segment is ready
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  uint32_t ringSize;
+  /// process of the server
+  std::atomic<uint32_t> serverPid;
+  /// process of the attached client, 0 if none
+  std::atomic<uint32_t> clientPid;
+  ShmRing rings[2];
+};
+
+inline void futexWait(std::atomic<uint32_t>* word, uint32_t val, const timespec* timeout)
+{
+  // not FUTEX_PRIVATE_FLAG, the word is in memory shared with another process
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+inline void futexWake(std::atomic<uint32_t>* word)
+{
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// the process may be owned by another user, it exists then too
+inline bool processAlive(uint32_t pid)
+{
+  return pid != 0 && (kill((pid_t)pid, 0) == 0 || errno == EPERM);
+}
+
+// wake up the peer if it announced sleeping, the announcement is read first to avoid bouncing the line
+inline bool wakeIfWaiting(std::atomic<uint32_t>& waiting)
+{
+  if (waiting.load() != 0 && waiting.exchange(0) != 0) {
+    futexWake(&waiting);
+    return true;
+  }
+  return false;
+}
+
+ShmChannel::ShmChannel(const std::string& name, unsigned ringSize, bool server)
+  :ShmChannel(name, ringSize, server, Config())
+{
+}
+
+ShmChannel::ShmChannel(const std::string& name, unsigned ringSize, bool server, const Config& cfg)
+  :m_name(SHM_PREFIX + name)
+  , m_server(server)
+  , m_segment(nullptr)
+  , m_segmentSize(0)
+  , m_ringSize(0)
+  , m_ringMask(0)
+  , m_spinTime(cfg.spinTime)
+  , m_sendTimeout(cfg.sendTimeout)
+{
+  TRC_ENTER(PAR(name) << PAR(ringSize) << PAR(server));
+
+  m_runListenThread = true;
+  m_state = State::NotReady;
+  m_sent = 0;
+  m_received = 0;
+  m_sendDropped = 0;
+  m_sleeps = 0;
+  m_wakeups = 0;
+
+  if (m_server)
+    create(ringSize);
+  else
+    attach();
+
+  unsigned char* data = (unsigned char*)m_segment + sizeof(ShmSegment);
+  int rx = m_server ? 1 : 0;
+  m_rxRing = &m_segment->rings[rx];
+  m_rxData = data + rx * m_ringSize;
+  m_txRing = &m_segment->rings[rx ^ 1];
+  m_txData = data + (rx ^ 1) * m_ringSize;
+
+  m_listenThread = std::thread(&ShmChannel::listen, this);
+  TRC_LEAVE(PAR(m_ringSize));
+}
+
+ShmChannel::~ShmChannel()
+{
+  TRC_DBG("joining shm listening thread");
+  m_runListenThread = false;
+  // the reader announces sleeping before it checks the flag, so it sees either the flag or the cleared word
+  m_rxRing->readerWaiting.store(0);
+  futexWake(&m_rxRing->readerWaiting);
+  if (m_listenThread.joinable())
+    m_listenThread.join();
+  TRC_DBG("listening thread joined");
+
+  if (!m_server) {
+    // detach so that another client may attach
+    uint32_t self = (uint32_t)getpid();
+    m_segment->clientPid.compare_exchange_strong(self, 0);
+  }
+
+  munmap(m_segment, m_segmentSize);
+  if (m_server)
+    shm_unlink(m_name.c_str());
+}
+
+void ShmChannel::create(unsigned ringSize)
+{
+  if (ringSize > MAX_RING_SIZE) {
+    THROW_EX(ShmChannelException, "ring size too big: " << PAR(ringSize));
+  }
+  m_ringSize = MIN_RING_SIZE;
+  while (m_ringSize < ringSize)
+    m_ringSize <<= 1;
+  m_ringMask = m_ringSize - 1;
+  m_segmentSize = sizeof(ShmSegment) + 2 * (size_t)m_ringSize;
+
+  // segment of a previous run may be still attached by an old client, it keeps its own copy
+  shm_unlink(m_name.c_str());
+  int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, SHM_PERMISSIONS);
+  if (fd < 0) {
+    THROW_EX(ShmChannelException, "shm_open() failed: " << PAR(m_name) << NAME_PAR(GetLastError, GetLastError()));
+  }
+
+  if (0 != ftruncate(fd, (off_t)m_segmentSize)) {
+    int err = errno;
+    close(fd);
+    shm_unlink(m_name.c_str());
+    THROW_EX(ShmChannelException, "ftruncate() failed: " << PAR(m_name) << NAME_PAR(GetLastError, err));
+  }
+
+  void* mem = mmap(NULL, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  int err = errno;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    shm_unlink(m_name.c_str());
+    THROW_EX(ShmChannelException, "mmap() failed: " << PAR(m_name) << NAME_PAR(GetLastError, err));
+  }
+
+  // ftruncate() zeroed the memory, that is the initial state of indexes and futex words
+  m_segment = (ShmSegment*)mem;
+  m_segment->version = SHM_VERSION;
+  m_segment->ringSize = m_ringSize;
+  m_segment->serverPid.store((uint32_t)getpid());
+  m_segment->magic.store(SHM_MAGIC, std::memory_order_release);
+  TRC_INF("shared memory created: " << PAR(m_name) << PAR(m_segmentSize));
+}
+
+void ShmChannel::attach()
+{
+  int fd = shm_open(m_name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    THROW_EX(ShmChannelException, "shm_open() failed: " << PAR(m_name) << NAME_PAR(GetLastError, GetLastError()));
+  }
+
+  struct stat st;
+  if (0 != fstat(fd, &st) || st.st_size < (off_t)sizeof(ShmSegment)) {
+    close(fd);
+    THROW_EX(ShmChannelException, "shared memory not ready: " << PAR(m_name));
+  }
+  m_segmentSize = (size_t)st.st_size;
+
+  void* mem = mmap(NULL, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  int err = errno;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    THROW_EX(ShmChannelException, "mmap() failed: " << PAR(m_name) << NAME_PAR(GetLastError, err));
+  }
+  m_segment = (ShmSegment*)mem;
+
+  uint32_t magic = m_segment->magic.load(std::memory_order_acquire);
+  uint32_t version = m_segment->version;
+  m_ringSize = m_segment->ringSize;
+  if (magic != SHM_MAGIC || version != SHM_VERSION || m_ringSize < MIN_RING_SIZE || (m_ringSize & (m_ringSize - 1)) != 0
+    || m_segmentSize != sizeof(ShmSegment) + 2 * (size_t)m_ringSize) {
+    munmap(mem, m_segmentSize);
+    THROW_EX(ShmChannelException, "shared memory not ready or incompatible: " << PAR(m_name) << PAR(magic) << PAR(version) << PAR(m_ringSize));
+  }
+  m_ringMask = m_ringSize - 1;
+
+  // one client at a time, the client of a dead process is replaced
+  uint32_t self = (uint32_t)getpid();
+  uint32_t client = 0;
+  while (!m_segment->clientPid.compare_exchange_strong(client, self)) {
+    if (processAlive(client)) {
+      munmap(mem, m_segmentSize);
+      THROW_EX(ShmChannelException, "shared memory already attached: " << PAR(m_name) << PAR(client));
+    }
+    TRC_WAR("previous client died, replaced: " << PAR(m_name) << PAR(client));
+  }
+  TRC_INF("shared memory attached: " << PAR(m_name) << PAR(m_segmentSize));
+}
+
+void ShmChannel::copyToRing(uint32_t pos, const unsigned char* src, uint32_t len)
+{
+  uint32_t offset = pos & m_ringMask;
+  uint32_t first = std::min(len, m_ringSize - offset);
+  memcpy(m_txData + offset, src, first);
+  memcpy(m_txData, src + first, len - first);
+}
+
+void ShmChannel::copyFromRing(uint32_t pos, unsigned char* dst, uint32_t len)
+{
+  uint32_t offset = pos & m_ringMask;
+  uint32_t first = std::min(len, m_ringSize - offset);
+  memcpy(dst, m_rxData + offset, first);
+  memcpy(dst + first, m_rxData, len - first);
+}
+
+void ShmChannel::listen()
+{
+  TRC_ENTER("thread starts");
+  m_state = State::Ready;
+
+  uint32_t tail = m_rxRing->tail.load(std::memory_order_relaxed);
+  while (m_runListenThread) {
+    uint32_t head = m_rxRing->head.load(std::memory_order_acquire);
+    if (head == tail) {
+      waitForData(tail);
+      continue;
+    }
+
+    // all published messages are read without touching head again
+    while (tail != head) {
+      uint32_t len = 0;
+      copyFromRing(tail, (unsigned char*)&len, sizeof(len));
+      if (head - tail < sizeof(len) || len > head - tail - sizeof(len)) {
+        TRC_ERR("corrupted ring, listening stopped: " << PAR(m_name) << PAR(len) << PAR(head) << PAR(tail));
+        m_runListenThread = false;
+        break;
+      }
+
+      std::basic_string<unsigned char> message(len, 0);
+      if (len > 0)
+        copyFromRing(tail + sizeof(len), &message[0], len);
+      tail += sizeof(len) + len;
+      // free the space before the handler runs, the peer may be waiting for it
+      m_rxRing->tail.store(tail);
+      if (wakeIfWaiting(m_rxRing->writerWaiting))
+        m_wakeups++;
+
+      m_received++;
+      dispatch(message);
+    }
+  }
+
+  m_state = State::NotReady;
+  TRC_LEAVE("thread stopped");
+}
+
+void ShmChannel::waitForData(uint32_t tail)
+{
+  if (m_spinTime.count() > 0) {
+    auto until = std::chrono::steady_clock::now() + m_spinTime;
+    while (m_rxRing->head.load(std::memory_order_acquire) == tail) {
+      if (!m_runListenThread || std::chrono::steady_clock::now() >= until)
+        break;
+      std::this_thread::yield();
+    }
+    if (m_rxRing->head.load(std::memory_order_acquire) != tail)
+      return;
+  }
+
+  // announce sleeping before the last check, the writer publishes head before reading the announcement
+  m_rxRing->readerWaiting.store(1);
+  if (m_rxRing->head.load() == tail && m_runListenThread) {
+    m_sleeps++;
+    futexWait(&m_rxRing->readerWaiting, 1, NULL);
+  }
+  m_rxRing->readerWaiting.store(0);
+}
+
+bool ShmChannel::waitForSpace(uint32_t head, uint32_t need)
+{
+  if (m_ringSize - (head - m_txRing->tail.load(std::memory_order_acquire)) >= need)
+    return true;
+
+  auto deadline = std::chrono::steady_clock::now() + m_sendTimeout;
+  bool ret = false;
+  while (true) {
+    m_txRing->writerWaiting.store(1);
+    if (m_ringSize - (head - m_txRing->tail.load()) >= need) {
+      ret = true;
+      break;
+    }
+
+    auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0)
+      break;
+    timespec timeout;
+    timeout.tv_sec = (time_t)(left.count() / 1000000000);
+    timeout.tv_nsec = (long)(left.count() % 1000000000);
+    futexWait(&m_txRing->writerWaiting, 1, &timeout);
+  }
+  m_txRing->writerWaiting.store(0);
+  return ret;
+}
+
+void ShmChannel::dispatch(const std::basic_string<unsigned char>& message)
+{
+  HandlerSlot<ReceiveFromFunc>::Reader receiveFromFunc(m_receiveFromFunc);
+  if (receiveFromFunc) {
+    (*receiveFromFunc)(message);
+  }
+  else {
+    TRC_WAR("Unregistered receiveFrom() handler");
+  }
+}
+
+void ShmChannel::sendTo(const std::basic_string<unsigned char>& message)
+{
+  TRC_DBG("Send to SHM: " << std::endl << FORM_HEX(message.data(), message.size()));
+
+  if (message.size() > getMaxMessageSize()) {
+    THROW_EX(ShmChannelException, "message too long: " << PAR(message.size()) << PAR(getMaxMessageSize()));
+  }
+  uint32_t len = (uint32_t)message.size();
+  uint32_t need = sizeof(len) + len;
+
+  std::lock_guard<std::mutex> lck(m_sendMtx);
+
+  uint32_t head = m_txRing->head.load(std::memory_order_relaxed);
+  if (!waitForSpace(head, need)) {
+    m_sendDropped++;
+    THROW_EX(ShmChannelException, "ring full, send timed out: " << PAR(m_name) << PAR(len));
+  }
+
+  copyToRing(head, (const unsigned char*)&len, sizeof(len));
+  copyToRing(head + sizeof(len), message.data(), len);
+  m_txRing->head.store(head + need);
+  m_sent++;
+
+  if (wakeIfWaiting(m_txRing->readerWaiting))
+    m_wakeups++;
+}
+
+void ShmChannel::registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
+{
+  m_receiveFromFunc.set(receiveFromFunc);
+}
+
+void ShmChannel::unregisterReceiveFromHandler()
+{
+  m_receiveFromFunc.reset();
+}
+
+IChannel::State ShmChannel::getState()
+{
+  if (m_state != State::Ready)
+    return m_state;
+  uint32_t peer = m_server ? m_segment->clientPid.load() : m_segment->serverPid.load();
+  return processAlive(peer) ? State::Ready : State::NotReady;
+}
+
+ShmChannel::Stats ShmChannel::getStats() const
+{
+  Stats stats;
+  stats.sent = m_sent;
+  stats.received = m_received;
+  stats.sendDropped = m_sendDropped;
+  stats.sleeps = m_sleeps;
+  stats.wakeups = m_wakeups;
+  return stats;
+}
+
+unsigned ShmChannel::getMaxMessageSize() const
+{
+  return m_ringSize - sizeof(uint32_t);
+}
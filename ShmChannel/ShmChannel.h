@@ -0,0 +1,162 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "PlatformDep.h"
+
+#include "IChannel.h"
+#include "HandlerSlot.h"
+#include <stdint.h>
+#include <string>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+struct ShmSegment;
+struct ShmRing;
+
+/// \class ShmChannel
+/// \brief Local IPC channel over shared memory (Linux only)
+/// \details
+/// Server creates shared memory segment with two single producer single consumer rings, one for each
+/// direction. Client attaches to the existing segment. Messages are copied to the ring directly,
+/// a system call is made only to wake up the peer sleeping on empty ring (or full ring if sending).
+/// One server talks to one client, the segment is recreated when the server starts.
+/// Processes of both sides are recorded in the segment, a second client is refused while the first one lives.
+class ShmChannel : public IChannel
+{
+public:
+  /// Channel parameters
+  struct Config
+  {
+    Config()
+      :spinTime(0)
+      , sendTimeout(1000)
+    {}
+
+    /// reader polls empty ring this time before it sleeps in futex, 0 sleeps immediately
+    /// trades a busy CPU core for lower latency of message bursts
+    std::chrono::microseconds spinTime;
+    /// max wait for free space in full ring, sendTo() throws then
+    std::chrono::milliseconds sendTimeout;
+  };
+
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t sent;
+    uint64_t received;
+    /// messages refused for full ring, see Config::sendTimeout
+    uint64_t sendDropped;
+    /// futex waits of the listen thread on empty ring
+    uint64_t sleeps;
+    /// futex wake-ups sent to the peer
+    uint64_t wakeups;
+  };
+
+  /// \brief Create or attach channel
+  /// \param [in] name shared memory name without leading slash
+  /// \param [in] ringSize capacity of each ring in bytes, rounded up to power of 2, server only
+  /// \param [in] server create the segment if true, attach to the existing one otherwise
+  /// \throw ShmChannelException if the segment can't be created, isn't ready or another client is attached
+  ShmChannel(const std::string& name, unsigned ringSize, bool server = false);
+  ShmChannel(const std::string& name, unsigned ringSize, bool server, const Config& cfg);
+  virtual ~ShmChannel();
+
+  /// \brief Send message
+  /// \details
+  /// Waits for free space up to Config::sendTimeout if the ring is full.
+  /// \throw ShmChannelException if the message doesn't fit in the ring or send timed out
+  void sendTo(const std::basic_string<unsigned char>& message) override;
+  void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) override;
+  void unregisterReceiveFromHandler() override;
+
+  /// \brief Get channel state
+  /// \details
+  /// Ready if listening and the peer process is attached and alive, NotReady otherwise.
+  State getState() override;
+
+  Stats getStats() const;
+
+  /// \brief Get max message size
+  unsigned getMaxMessageSize() const;
+
+private:
+  ShmChannel();
+  ShmChannel(const ShmChannel&);
+  ShmChannel& operator = (const ShmChannel&);
+
+  void create(unsigned ringSize);
+  void attach();
+  void listen();
+  // wait until the ring has data at tail or the thread stops
+  void waitForData(uint32_t tail);
+  // wait until the ring has need bytes free at head
+  bool waitForSpace(uint32_t head, uint32_t need);
+  void copyToRing(uint32_t pos, const unsigned char* src, uint32_t len);
+  void copyFromRing(uint32_t pos, unsigned char* dst, uint32_t len);
+  void dispatch(const std::basic_string<unsigned char>& message);
+
+  HandlerSlot<ReceiveFromFunc> m_receiveFromFunc;
+
+  std::string m_name;
+  bool m_server;
+  ShmSegment* m_segment;
+  size_t m_segmentSize;
+  uint32_t m_ringSize;
+  uint32_t m_ringMask;
+  ShmRing* m_rxRing;
+  unsigned char* m_rxData;
+  ShmRing* m_txRing;
+  unsigned char* m_txData;
+
+  std::chrono::microseconds m_spinTime;
+  std::chrono::milliseconds m_sendTimeout;
+
+  // senders share the producer side of the ring
+  std::mutex m_sendMtx;
+
+  std::atomic_bool m_runListenThread;
+  std::thread m_listenThread;
+  std::atomic<State> m_state;
+
+  std::atomic<uint64_t> m_sent;
+  std::atomic<uint64_t> m_received;
+  std::atomic<uint64_t> m_sendDropped;
+  std::atomic<uint64_t> m_sleeps;
+  std::atomic<uint64_t> m_wakeups;
+};
+
+class ShmChannelException : public std::exception {
+public:
+  ShmChannelException(const std::string& cause)
+    :m_cause(cause)
+  {}
+
+  virtual const char* what() const noexcept(true)
+  {
+    return m_cause.c_str();
+  }
+
+  virtual ~ShmChannelException()
+  {}
+
+protected:
+  std::string m_cause;
+};
@@ -0,0 +1,515 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TcpChannel.h"
+#include "IqrfLogging.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+// max receive calls for one peer per wake-up, the other peers wait meanwhile
+const unsigned READ_BATCH = 16;
+// frame length in network byte order
+const size_t HEADER_SIZE = 4;
+// min receive buffer per peer, several small frames are read by one call
+const size_t RX_MIN_SIZE = 16 * 1024;
+// max frames written by one call
+const int MAX_IOV = 64;
+
+inline std::string addrToString(const sockaddr_in& addr)
+{
+  char buf[INET_ADDRSTRLEN] = { 0 };
+  inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf));
+  return std::string(buf) + ':' + std::to_string(ntohs(addr.sin_port));
+}
+
+// peer in traces
+inline std::ostream& operator << (std::ostream& os, const TcpChannel::PeerInfo& info)
+{
+  return os << info.id << ' ' << addrToString(info.addr);
+}
+
+TcpChannel::Peer::~Peer()
+{
+  close(mFd);
+}
+
+TcpChannel::TcpChannel(const std::string& host, unsigned short port, unsigned bufsize, bool server)
+  :TcpChannel(host, port, bufsize, server, Config())
+{
+}
+
+TcpChannel::TcpChannel(const std::string& host, unsigned short port, unsigned bufsize, bool server, const Config& cfg)
+  :m_server(server)
+  , m_listenPort(0)
+  , m_noDelay(cfg.noDelay)
+  , m_sendBufferSize(cfg.sendBufferSize)
+  , m_sendTimeout(cfg.sendTimeout)
+  , m_connectTimeout(cfg.connectTimeout)
+  , m_bufsize(bufsize)
+  , m_peers(server, cfg.maxPeers, cfg.reconnectPeriod, {
+      [this](int fd, const sockaddr_storage& addr, uint32_t id) { return makePeer(fd, addr, id); },
+      [this](Peer& peer, uint32_t events) { peerEvents(peer, events); },
+      [this]() { connectServer(); },
+      [this](Peer& peer) { closePeer(peer); } })
+{
+  TRC_ENTER(PAR(host) << PAR(port) << PAR(bufsize) << PAR(server));
+
+  memset(&m_serverAddr, 0, sizeof(m_serverAddr));
+  m_received = 0;
+  m_sent = 0;
+  m_writeCalls = 0;
+  m_oversized = 0;
+
+  if (m_server) {
+    createServer(host, port);
+  }
+  else {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int err = host.empty() ? EAI_NONAME : getaddrinfo(host.c_str(), NULL, &hints, &result);
+    if (err != 0) {
+      THROW_EX(TcpChannelException, "getaddrinfo() failed: " << PAR(host) << NAME_PAR(error, gai_strerror(err)));
+    }
+    m_serverAddr = *(sockaddr_in*)result->ai_addr;
+    m_serverAddr.sin_port = htons(port);
+    freeaddrinfo(result);
+
+    if (!connectServer()) {
+      TRC_WAR("server not available, connecting in background: " << NAME_PAR(server, addrToString(m_serverAddr)));
+    }
+  }
+
+  m_peers.start();
+  TRC_LEAVE("");
+}
+
+TcpChannel::~TcpChannel()
+{
+  // the thread uses the channel
+  m_peers.stop();
+}
+
+void TcpChannel::createServer(const std::string& host, unsigned short port)
+{
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (!host.empty() && 1 != inet_pton(AF_INET, host.c_str(), &addr.sin_addr)) {
+    THROW_EX(TcpChannelException, "invalid listen address: " << PAR(host));
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    THROW_EX(TcpChannelException, "socket() failed: " << NAME_PAR(GetLastError, GetLastError()));
+  }
+  // closed by m_peers from now on
+  m_peers.setListenSocket(fd);
+
+  // restarted server binds the port still in TIME_WAIT
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  if (0 != bind(fd, (sockaddr*)&addr, sizeof(addr))) {
+    THROW_EX(TcpChannelException, "bind() failed: " << PAR(host) << PAR(port) << NAME_PAR(GetLastError, GetLastError()));
+  }
+  if (0 != ::listen(fd, SOMAXCONN)) {
+    THROW_EX(TcpChannelException, "listen() failed: " << NAME_PAR(GetLastError, GetLastError()));
+  }
+
+  socklen_t len = sizeof(addr);
+  getsockname(fd, (sockaddr*)&addr, &len);
+  m_listenPort = ntohs(addr.sin_port);
+  TRC_INF("listening: " << NAME_PAR(address, addrToString(addr)));
+}
+
+bool TcpChannel::connectServer()
+{
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    TRC_WAR("socket() failed: " << NAME_PAR(GetLastError, GetLastError()));
+    return false;
+  }
+
+  // non-blocking connect limits the wait of unreachable server
+  int res = connect(fd, (sockaddr*)&m_serverAddr, sizeof(m_serverAddr));
+  if (res != 0 && errno == EINPROGRESS) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    res = poll(&pfd, 1, (int)m_connectTimeout.count());
+    if (res == 1) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      res = err == 0 ? 0 : -1;
+      errno = err;
+    }
+    else {
+      res = -1;
+      errno = ETIMEDOUT;
+    }
+  }
+  if (res != 0) {
+    TRC_DBG("connect() failed: " << NAME_PAR(server, addrToString(m_serverAddr)) << NAME_PAR(GetLastError, GetLastError()));
+    close(fd);
+    return false;
+  }
+
+  sockaddr_storage addr;
+  memset(&addr, 0, sizeof(addr));
+  memcpy(&addr, &m_serverAddr, sizeof(m_serverAddr));
+  return m_peers.addPeer(fd, addr) != nullptr;
+}
+
+std::shared_ptr<TcpChannel::Peer> TcpChannel::makePeer(int fd, const sockaddr_storage& addr, uint32_t id)
+{
+  if (m_noDelay) {
+    int on = 1;
+    if (0 != setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+      TRC_WAR("setsockopt(TCP_NODELAY) failed: " << NAME_PAR(GetLastError, GetLastError()));
+    }
+  }
+
+  PeerInfo info;
+  info.id = id;
+  info.addr = *(const sockaddr_in*)&addr;
+
+  // a whole frame always fits, so it is passed to handlers from the buffer
+  size_t rxSize = HEADER_SIZE + m_bufsize;
+  return std::shared_ptr<Peer>(ant_new Peer(fd, info, rxSize > RX_MIN_SIZE ? rxSize : RX_MIN_SIZE));
+}
+
+void TcpChannel::closePeer(Peer& peer)
+{
+  // queued frames are dropped, waiting sendTo() fails
+  std::lock_guard<std::mutex> lck(peer.mSendMtx);
+  peer.mClosed = true;
+  peer.mSendQueue.clear();
+  peer.mSendQueued = 0;
+  peer.mSendCv.notify_all();
+}
+
+void TcpChannel::peerEvents(Peer& peer, uint32_t events)
+{
+  if (events & EPOLLOUT)
+    writePeer(peer);
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    readPeer(peer, events);
+}
+
+void TcpChannel::readPeer(Peer& peer, uint32_t events)
+{
+  uint32_t id = peer.mInfo.id;
+  // data sent before hang-up are all read, then recv() returns 0
+  bool hangup = (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+  for (unsigned i = 0; hangup || i < READ_BATCH; i++) {
+    ssize_t len = recv(peer.mFd, &peer.mRx[peer.mRxLen], peer.mRx.size() - peer.mRxLen, MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (hangup)
+          m_peers.removePeer(id);
+        return;
+      }
+      TRC_WAR("recv() failed: " << PAR(id) << NAME_PAR(GetLastError, GetLastError()));
+      m_peers.removePeer(id);
+      return;
+    }
+    if (len == 0) {
+      m_peers.removePeer(id);
+      return;
+    }
+    peer.mRxLen += len;
+
+    // complete frames are dispatched from the buffer
+    size_t pos = 0;
+    while (peer.mRxLen - pos >= HEADER_SIZE) {
+      const unsigned char* frame = &peer.mRx[pos];
+      uint32_t size = (uint32_t)frame[0] << 24 | (uint32_t)frame[1] << 16 | (uint32_t)frame[2] << 8 | frame[3];
+      if (size > m_bufsize) {
+        // the stream can't be resynchronized
+        TRC_WAR("frame longer than buffer, disconnecting: " << PAR(id) << PAR(size) << PAR(m_bufsize));
+        m_oversized++;
+        m_peers.removePeer(id);
+        return;
+      }
+      if (peer.mRxLen - pos - HEADER_SIZE < size)
+        break;
+
+      m_message.assign(frame + HEADER_SIZE, size);
+      m_received++;
+      m_peers.dispatch(m_message, peer.mInfo);
+      pos += HEADER_SIZE + size;
+    }
+
+    // partial frame moved to the buffer start
+    if (pos > 0) {
+      memmove(&peer.mRx[0], &peer.mRx[pos], peer.mRxLen - pos);
+      peer.mRxLen -= pos;
+    }
+  }
+}
+
+void TcpChannel::writePeer(Peer& peer)
+{
+  int err;
+  {
+    std::lock_guard<std::mutex> lck(peer.mSendMtx);
+    err = flushPeer(peer);
+  }
+  if (err != 0) {
+    TRC_WAR("send failed: " << NAME_PAR(id, peer.mInfo.id) << NAME_PAR(error, strerror(err)));
+    m_peers.removePeer(peer.mInfo.id);
+  }
+}
+
+int TcpChannel::flushPeer(Peer& peer)
+{
+  while (!peer.mSendQueue.empty()) {
+    iovec iov[MAX_IOV];
+    int count = 0;
+    size_t offset = peer.mSendOffset;
+    for (auto it = peer.mSendQueue.begin(); it != peer.mSendQueue.end() && count < MAX_IOV; it++) {
+      iov[count].iov_base = (void*)(it->data() + offset);
+      iov[count].iov_len = it->size() - offset;
+      offset = 0;
+      count++;
+    }
+
+    // sendmsg() is writev() with MSG_NOSIGNAL
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t len = sendmsg(peer.mFd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the rest is written by the listen thread when the socket is writable
+        watchWrite(peer, true);
+        peer.mSendCv.notify_all();
+        return 0;
+      }
+      int err = errno;
+      peer.mClosed = true;
+      peer.mSendQueue.clear();
+      peer.mSendQueued = 0;
+      peer.mSendCv.notify_all();
+      return err;
+    }
+    m_writeCalls++;
+
+    size_t written = len;
+    while (written > 0) {
+      size_t rest = peer.mSendQueue.front().size() - peer.mSendOffset;
+      if (written < rest) {
+        peer.mSendOffset += written;
+        break;
+      }
+      written -= rest;
+      peer.mSendQueued -= peer.mSendQueue.front().size();
+      peer.mSendQueue.pop_front();
+      peer.mSendOffset = 0;
+      m_sent++;
+    }
+  }
+
+  watchWrite(peer, false);
+  peer.mSendCv.notify_all();
+  return 0;
+}
+
+void TcpChannel::watchWrite(Peer& peer, bool enable)
+{
+  if (peer.mWantWrite == enable || peer.mClosed)
+    return;
+
+  if (!m_peers.watchPeer(peer, EPOLLIN | EPOLLRDHUP | (enable ? (uint32_t)EPOLLOUT : 0u))) {
+    TRC_WAR("epoll_ctl() failed: " << NAME_PAR(GetLastError, GetLastError()));
+    return;
+  }
+  peer.mWantWrite = enable;
+}
+
+void TcpChannel::queueFrames(Peer& peer, const std::basic_string<unsigned char>* messages, size_t count)
+{
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (messages[i].size() > UINT32_MAX) {
+      THROW_EX(TcpChannelException, "message too long: " << NAME_PAR(size, messages[i].size()));
+    }
+    bytes += HEADER_SIZE + messages[i].size();
+  }
+
+  std::unique_lock<std::mutex> lck(peer.mSendMtx);
+
+  // a batch longer than the whole queue is accepted if the queue is empty
+  auto hasRoom = [&] {
+    return peer.mClosed || peer.mSendQueued == 0 || peer.mSendQueued + bytes <= m_sendBufferSize;
+  };
+  bool room = hasRoom();
+  if (!room) {
+    // the socket may have drained since the last write, don't wait for EPOLLOUT then
+    int err = flushPeer(peer);
+    if (err != 0) {
+      THROW_EX(TcpChannelException, "send failed: " << NAME_PAR(peer, peer.mInfo.id) << NAME_PAR(error, strerror(err)));
+    }
+    room = hasRoom();
+  }
+  if (!room && !m_peers.isEpollThread()) {
+    // the listen thread drains the queue, it can't wait for itself
+    auto deadline = std::chrono::steady_clock::now() + m_sendTimeout;
+    room = peer.mSendCv.wait_until(lck, deadline, hasRoom);
+  }
+  if (peer.mClosed) {
+    THROW_EX(TcpChannelException, "peer disconnected: " << NAME_PAR(peer, peer.mInfo.id));
+  }
+  if (!room) {
+    THROW_EX(TcpChannelException, "send queue full: " << NAME_PAR(peer, peer.mInfo.id) << NAME_PAR(queued, peer.mSendQueued));
+  }
+
+  // non-empty queue is being written by the listen thread, the frames join it
+  bool idle = peer.mSendQueue.empty();
+  for (size_t i = 0; i < count; i++) {
+    const std::basic_string<unsigned char>& message = messages[i];
+    uint32_t size = (uint32_t)message.size();
+    std::basic_string<unsigned char> frame;
+    frame.reserve(HEADER_SIZE + size);
+    frame.push_back((unsigned char)(size >> 24));
+    frame.push_back((unsigned char)(size >> 16));
+    frame.push_back((unsigned char)(size >> 8));
+    frame.push_back((unsigned char)size);
+    frame.append(message);
+    peer.mSendQueue.push_back(std::move(frame));
+  }
+  peer.mSendQueued += bytes;
+
+  if (idle) {
+    int err = flushPeer(peer);
+    if (err != 0) {
+      THROW_EX(TcpChannelException, "send failed: " << NAME_PAR(peer, peer.mInfo.id) << NAME_PAR(error, strerror(err)));
+    }
+  }
+}
+
+void TcpChannel::sendTo(const std::basic_string<unsigned char>& message)
+{
+  uint32_t id = m_peers.getLastPeerId();
+  if (id == 0) {
+    THROW_EX(TcpChannelException, "no peer to send to");
+  }
+  sendTo(id, message);
+}
+
+void TcpChannel::sendTo(uint32_t peerId, const std::basic_string<unsigned char>& message)
+{
+  TRC_DBG("Send to tcp: " << PAR(peerId) << std::endl << FORM_HEX(message.data(), message.size()));
+
+  std::shared_ptr<Peer> peer = m_peers.findPeer(peerId);
+  if (!peer) {
+    THROW_EX(TcpChannelException, "peer not connected: " << PAR(peerId));
+  }
+  queueFrames(*peer, &message, 1);
+}
+
+void TcpChannel::sendBatchTo(uint32_t peerId, const std::vector<std::basic_string<unsigned char>>& messages)
+{
+  if (messages.empty())
+    return;
+
+  std::shared_ptr<Peer> peer = m_peers.findPeer(peerId);
+  if (!peer) {
+    THROW_EX(TcpChannelException, "peer not connected: " << PAR(peerId));
+  }
+  queueFrames(*peer, messages.data(), messages.size());
+}
+
+void TcpChannel::registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
+{
+  m_peers.registerReceiveFromHandler(receiveFromFunc);
+}
+
+void TcpChannel::unregisterReceiveFromHandler()
+{
+  m_peers.unregisterReceiveFromHandler();
+}
+
+void TcpChannel::registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc)
+{
+  m_peers.registerReceiveFromPeerHandler(receiveFromPeerFunc);
+}
+
+void TcpChannel::unregisterReceiveFromPeerHandler()
+{
+  m_peers.unregisterReceiveFromPeerHandler();
+}
+
+void TcpChannel::registerPeerEventHandler(PeerEventFunc peerEventFunc)
+{
+  m_peers.registerPeerEventHandler(peerEventFunc);
+}
+
+void TcpChannel::unregisterPeerEventHandler()
+{
+  m_peers.unregisterPeerEventHandler();
+}
+
+IChannel::State TcpChannel::getState()
+{
+  return m_peers.getState();
+}
+
+std::vector<TcpChannel::PeerInfo> TcpChannel::getPeers() const
+{
+  return m_peers.getPeers();
+}
+
+TcpChannel::Stats TcpChannel::getStats() const
+{
+  Stats stats;
+  stats.received = m_received;
+  stats.sent = m_sent;
+  stats.writeCalls = m_writeCalls;
+  stats.oversized = m_oversized;
+  EpollPeers<Peer, PeerInfo, TcpChannelException>::Stats peerStats = m_peers.getStats();
+  stats.connected = peerStats.connected;
+  stats.rejected = peerStats.rejected;
+  stats.disconnected = peerStats.disconnected;
+  stats.peers = peerStats.peers;
+  stats.sendQueued = 0;
+  m_peers.forEachPeer([&](Peer& peer) {
+    std::lock_guard<std::mutex> sendLck(peer.mSendMtx);
+    stats.sendQueued += peer.mSendQueued;
+  });
+  return stats;
+}
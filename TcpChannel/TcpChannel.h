@@ -0,0 +1,251 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "PlatformDep.h"
+
+#include "IChannel.h"
+#include "EpollPeers.h"
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
+/// \class TcpChannel
+/// \brief Stream channel over TCP (Linux only)
+/// \details
+/// Each message is sent as a frame of 4 bytes length in network byte order followed by the payload.
+/// Server accepts many connections, client connects to the server and reconnects if the connection is lost.
+/// All sockets are served by one epoll thread which invokes the handlers.
+/// Frames waiting for room in the socket buffer are queued per connection and written together
+/// by one vectored write when the socket becomes writable.
+class TcpChannelException;
+
+class TcpChannel : public IChannel
+{
+public:
+  /// Channel parameters
+  struct Config
+  {
+    Config()
+      :maxPeers(64)
+      , noDelay(true)
+      , sendBufferSize(1024 * 1024)
+      , sendTimeout(1000)
+      , connectTimeout(1000)
+      , reconnectPeriod(1000)
+    {}
+
+    /// server rejects connections above this number of peers
+    unsigned maxPeers;
+    /// disable Nagle's algorithm (TCP_NODELAY), frames are coalesced by the channel instead
+    bool noDelay;
+    /// max bytes of frames queued per connection, sendTo() waits for the queue to drain then
+    unsigned sendBufferSize;
+    /// max wait for room in the send queue, sendTo() throws then
+    /// sendTo() called from a handler doesn't wait, it throws at once if the queue is full
+    std::chrono::milliseconds sendTimeout;
+    /// max wait for the client connection to be established
+    std::chrono::milliseconds connectTimeout;
+    /// client connection attempts period while the server isn't available
+    std::chrono::milliseconds reconnectPeriod;
+  };
+
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t received;
+    uint64_t sent;
+    /// vectored writes, less than sent if frames were coalesced
+    uint64_t writeCalls;
+    /// frames longer than bufsize, the connection is closed
+    uint64_t oversized;
+    /// peers connected to the server or connects of the client
+    uint64_t connected;
+    /// peers refused for Config::maxPeers
+    uint64_t rejected;
+    uint64_t disconnected;
+    /// currently connected peers
+    uint64_t peers;
+    /// bytes waiting in the send queues
+    uint64_t sendQueued;
+  };
+
+  /// Connected peer
+  struct PeerInfo
+  {
+    /// unique within the channel, the server is the peer of the client
+    uint32_t id;
+    /// remote endpoint
+    sockaddr_in addr;
+  };
+
+  // receive data handler with the source peer
+  typedef std::function<int(const std::basic_string<unsigned char>&, const PeerInfo&)> ReceiveFromPeerFunc;
+
+  // peer connection handler, connected is false if the peer disconnected
+  typedef std::function<void(const PeerInfo&, bool connected)> PeerEventFunc;
+
+  /// \brief Create server or client
+  /// \param [in] host server: local IPv4 address to listen on, empty for any; client: server name or address
+  /// \param [in] port server port, 0 lets the server choose a free port (see getListeningPort())
+  /// \param [in] bufsize max received message size, longer frame closes the connection
+  /// \param [in] server accept connections if true, connect to the server otherwise
+  /// \throw TcpChannelException if the server socket can't be created or the host can't be resolved
+  /// \details
+  /// Client doesn't fail if the server isn't available yet, it connects later in background.
+  TcpChannel(const std::string& host, unsigned short port, unsigned bufsize, bool server = false);
+  TcpChannel(const std::string& host, unsigned short port, unsigned bufsize, bool server, const Config& cfg);
+  virtual ~TcpChannel();
+
+  /// \brief Send to the server (client) or to the peer of the last message (server)
+  /// \throw TcpChannelException if there is no such peer, the peer disconnected or the send queue is full
+  void sendTo(const std::basic_string<unsigned char>& message) override;
+  void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) override;
+  void unregisterReceiveFromHandler() override;
+  State getState() override;
+
+  /// \brief Send to given peer
+  /// \details
+  /// The frame is written immediately if nothing is queued for the peer, otherwise it is queued
+  /// and written with the other queued frames.
+  /// \throw TcpChannelException if the peer disconnected or the send queue is full
+  void sendTo(uint32_t peerId, const std::basic_string<unsigned char>& message);
+
+  /// \brief Send messages to given peer by one vectored write
+  /// \throw TcpChannelException if the peer disconnected or the send queue is full
+  void sendBatchTo(uint32_t peerId, const std::vector<std::basic_string<unsigned char>>& messages);
+
+  /// \brief Register handler getting the source peer of each message
+  /// \details
+  /// The handler takes precedence over the handler registered by registerReceiveFromHandler().
+  /// If it returns 0 the peer becomes the destination of sendTo() without peer.
+  void registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc);
+  void unregisterReceiveFromPeerHandler();
+
+  /// \brief Register handler of peer connects and disconnects
+  /// \details
+  /// Invoked from the channel thread before the first message of the peer and after its last message.
+  void registerPeerEventHandler(PeerEventFunc peerEventFunc);
+  void unregisterPeerEventHandler();
+
+  /// \brief Get connected peers
+  std::vector<PeerInfo> getPeers() const;
+
+  /// \brief Get port the server listens on, 0 for client
+  unsigned short getListeningPort() const { return m_listenPort; }
+
+  Stats getStats() const;
+
+private:
+  // connected socket, closed when the last sender releases it
+  struct Peer
+  {
+    Peer(int fd, const PeerInfo& info, size_t rxSize)
+      :mFd(fd)
+      , mInfo(info)
+      , mRx(rxSize)
+      , mRxLen(0)
+      , mSendOffset(0)
+      , mSendQueued(0)
+      , mWantWrite(false)
+      , mClosed(false)
+    {}
+    ~Peer();
+
+    int mFd;
+    PeerInfo mInfo;
+
+    // partial frames, used by the listen thread only
+    std::vector<unsigned char> mRx;
+    size_t mRxLen;
+
+    std::mutex mSendMtx;
+    std::condition_variable mSendCv;
+    // frames with header, the first one written partially up to mSendOffset
+    std::deque<std::basic_string<unsigned char>> mSendQueue;
+    size_t mSendOffset;
+    size_t mSendQueued;
+    // EPOLLOUT is watched
+    bool mWantWrite;
+    bool mClosed;
+  };
+
+  TcpChannel();
+  TcpChannel(const TcpChannel&);
+  TcpChannel& operator = (const TcpChannel&);
+
+  void createServer(const std::string& host, unsigned short port);
+  bool connectServer();
+  std::shared_ptr<Peer> makePeer(int fd, const sockaddr_storage& addr, uint32_t id);
+  void peerEvents(Peer& peer, uint32_t events);
+  void closePeer(Peer& peer);
+  void readPeer(Peer& peer, uint32_t events);
+  void writePeer(Peer& peer);
+  void queueFrames(Peer& peer, const std::basic_string<unsigned char>* messages, size_t count);
+  // write queued frames until the socket is full, called with Peer::mSendMtx locked
+  // returns 0 or errno of failed write
+  int flushPeer(Peer& peer);
+  void watchWrite(Peer& peer, bool enable);
+
+  bool m_server;
+  // server address of the client
+  sockaddr_in m_serverAddr;
+  unsigned short m_listenPort;
+  bool m_noDelay;
+  unsigned m_sendBufferSize;
+  std::chrono::milliseconds m_sendTimeout;
+  std::chrono::milliseconds m_connectTimeout;
+
+  unsigned m_bufsize;
+  // received message passed to handlers, reused to avoid allocation per frame
+  std::basic_string<unsigned char> m_message;
+
+  std::atomic<uint64_t> m_received;
+  std::atomic<uint64_t> m_sent;
+  std::atomic<uint64_t> m_writeCalls;
+  std::atomic<uint64_t> m_oversized;
+
+  // destroyed first, its thread uses the members above
+  EpollPeers<Peer, PeerInfo, TcpChannelException> m_peers;
+};
+
+class TcpChannelException : public std::exception {
+public:
+  TcpChannelException(const std::string& cause)
+    :m_cause(cause)
+  {}
+
+  virtual const char* what() const noexcept(true)
+  {
+    return m_cause.c_str();
+  }
+
+  virtual ~TcpChannelException()
+  {}
+
+protected:
+  std::string m_cause;
+};
@@ -0,0 +1,213 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include "IoUring.h"
+#include "IqrfLogging.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+// ring indexes shared with kernel
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+IoUring::IoUring(unsigned entries)
+  :m_fd(-1)
+  , m_sqRing(MAP_FAILED)
+  , m_sqRingSize(0)
+  , m_cqRing(MAP_FAILED)
+  , m_cqRingSize(0)
+  , m_sqes((io_uring_sqe*)MAP_FAILED)
+  , m_sqesSize(0)
+  , m_sqPending(0)
+  , m_bufRing(nullptr)
+  , m_bufRingSize(0)
+  , m_bufRingMask(0)
+  , m_bufGroup(0)
+  , m_bufs(nullptr)
+  , m_bufSize(0)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  m_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (m_fd < 0) {
+    THROW_EX(IoUringException, "io_uring_setup failed: " << errno);
+  }
+
+  m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    // both rings share one mapping
+    if (m_cqRingSize > m_sqRingSize)
+      m_sqRingSize = m_cqRingSize;
+    m_cqRingSize = m_sqRingSize;
+  }
+
+  m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_sqRing == MAP_FAILED) {
+    int err = errno;
+    close(m_fd);
+    THROW_EX(IoUringException, "mmap SQ ring failed: " << err);
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    m_cqRing = m_sqRing;
+  }
+  else {
+    m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if (m_cqRing == MAP_FAILED) {
+      int err = errno;
+      munmap(m_sqRing, m_sqRingSize);
+      close(m_fd);
+      THROW_EX(IoUringException, "mmap CQ ring failed: " << err);
+    }
+  }
+
+  m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  m_sqes = (io_uring_sqe*)mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+  if (m_sqes == MAP_FAILED) {
+    int err = errno;
+    if (m_cqRing != m_sqRing)
+      munmap(m_cqRing, m_cqRingSize);
+    munmap(m_sqRing, m_sqRingSize);
+    close(m_fd);
+    THROW_EX(IoUringException, "mmap SQEs failed: " << err);
+  }
+
+  unsigned char* sq = (unsigned char*)m_sqRing;
+  m_sqHead = (unsigned*)(sq + params.sq_off.head);
+  m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+  m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  m_sqEntries = params.sq_entries;
+  m_sqArray = (unsigned*)(sq + params.sq_off.array);
+
+  unsigned char* cq = (unsigned char*)m_cqRing;
+  m_cqHead = (unsigned*)(cq + params.cq_off.head);
+  m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+  m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+  if (m_bufRing) {
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = m_bufGroup;
+    syscall(__NR_io_uring_register, m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(m_bufRing, m_bufRingSize);
+  }
+  munmap(m_sqes, m_sqesSize);
+  if (m_cqRing != m_sqRing)
+    munmap(m_cqRing, m_cqRingSize);
+  munmap(m_sqRing, m_sqRingSize);
+  close(m_fd);
+}
+
+io_uring_sqe* IoUring::getSqe()
+{
+  unsigned head = LOAD_ACQUIRE(m_sqHead);
+  unsigned tail = *m_sqTail + m_sqPending;
+  if (tail - head >= m_sqEntries)
+    return nullptr;
+
+  unsigned idx = tail & m_sqMask;
+  m_sqArray[idx] = idx;
+  m_sqPending++;
+
+  io_uring_sqe* sqe = &m_sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int IoUring::submit(unsigned waitNr)
+{
+  unsigned toSubmit = m_sqPending;
+  if (toSubmit > 0) {
+    STORE_RELEASE(m_sqTail, *m_sqTail + toSubmit);
+    m_sqPending = 0;
+  }
+
+  unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  int res = (int)syscall(__NR_io_uring_enter, m_fd, toSubmit, waitNr, flags, NULL, 0);
+  return res < 0 ? -errno : res;
+}
+
+io_uring_cqe* IoUring::peekCqe()
+{
+  unsigned head = *m_cqHead;
+  if (head == LOAD_ACQUIRE(m_cqTail))
+    return nullptr;
+  return &m_cqes[head & m_cqMask];
+}
+
+void IoUring::cqeSeen()
+{
+  STORE_RELEASE(m_cqHead, *m_cqHead + 1);
+}
+
+void IoUring::registerBufRing(unsigned short group, unsigned count, unsigned char* bufs, unsigned bufSize)
+{
+  m_bufRingSize = count * sizeof(io_uring_buf);
+  // kernel requires page aligned ring memory
+  void* ring = mmap(NULL, m_bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    THROW_EX(IoUringException, "mmap buffer ring failed: " << errno);
+  }
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (0 > syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    int err = errno;
+    munmap(ring, m_bufRingSize);
+    THROW_EX(IoUringException, "io_uring_register PBUF_RING failed: " << err);
+  }
+
+  m_bufRing = (io_uring_buf_ring*)ring;
+  m_bufRingMask = count - 1;
+  m_bufGroup = group;
+  m_bufs = bufs;
+  m_bufSize = bufSize;
+
+  for (unsigned i = 0; i < count; i++) {
+    io_uring_buf* buf = bufEntry(i);
+    buf->addr = (uint64_t)(uintptr_t)getBuf((unsigned short)i);
+    buf->len = bufSize;
+    buf->bid = (unsigned short)i;
+  }
+  STORE_RELEASE(&m_bufRing->tail, (unsigned short)count);
+}
+
+void IoUring::returnBuf(unsigned short bid)
+{
+  unsigned short tail = m_bufRing->tail;
+  io_uring_buf* buf = bufEntry(tail & m_bufRingMask);
+  buf->addr = (uint64_t)(uintptr_t)getBuf(bid);
+  buf->len = m_bufSize;
+  buf->bid = bid;
+  STORE_RELEASE(&m_bufRing->tail, (unsigned short)(tail + 1));
+}
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string>
+#include <exception>
+
+/// \class IoUring
+/// \brief Minimal io_uring instance on top of raw system calls
+/// \details
+/// Maps submission and completion queues of one ring and optionally one provided buffer ring.
+/// The instance isn't thread safe, SQEs are expected to be prepared and submitted by one thread.
+/// Completions are consumed by peekCqe() and cqeSeen() pairs.
+class IoUring
+{
+public:
+  /// \brief Create ring
+  /// \param [in] entries SQ size, rounded up to power of 2 by kernel
+  /// \throw IoUringException if the kernel doesn't support io_uring
+  IoUring(unsigned entries);
+  virtual ~IoUring();
+
+  /// \brief Get free SQE
+  /// \return cleared SQE or nullptr if SQ is full
+  io_uring_sqe* getSqe();
+
+  /// \brief Submit prepared SQEs
+  /// \param [in] waitNr number of completions to wait for
+  /// \return number of submitted SQEs or -errno
+  int submit(unsigned waitNr = 0);
+
+  /// \brief Get the oldest completion
+  /// \return CQE or nullptr if CQ is empty
+  io_uring_cqe* peekCqe();
+
+  /// \brief Release CQE got from peekCqe()
+  void cqeSeen();
+
+  /// \brief Register provided buffer ring
+  /// \details
+  /// Buffers are consecutive areas of bufSize bytes in bufs. They are all provided to kernel
+  /// and selected by SQEs with IOSQE_BUFFER_SELECT and given group.
+  /// \param [in] group buffer group ID
+  /// \param [in] count number of buffers, power of 2
+  /// \param [in] bufs buffer memory
+  /// \param [in] bufSize size of one buffer
+  /// \throw IoUringException if the kernel doesn't support provided buffer rings
+  void registerBufRing(unsigned short group, unsigned count, unsigned char* bufs, unsigned bufSize);
+
+  /// \brief Get provided buffer selected by completion
+  unsigned char* getBuf(unsigned short bid) { return m_bufs + (size_t)bid * m_bufSize; }
+
+  /// \brief Give buffer back to kernel
+  void returnBuf(unsigned short bid);
+
+private:
+  // entries start at the ring beginning, io_uring_buf_ring::bufs is misplaced by an empty struct in C++
+  io_uring_buf* bufEntry(unsigned idx) { return (io_uring_buf*)m_bufRing + idx; }
+
+  IoUring(const IoUring&);
+  IoUring& operator = (const IoUring&);
+
+  int m_fd;
+
+  void* m_sqRing;
+  size_t m_sqRingSize;
+  void* m_cqRing;
+  size_t m_cqRingSize;
+  io_uring_sqe* m_sqes;
+  size_t m_sqesSize;
+
+  unsigned* m_sqHead;
+  unsigned* m_sqTail;
+  unsigned m_sqMask;
+  unsigned m_sqEntries;
+  unsigned* m_sqArray;
+  // SQEs prepared since the last submit()
+  unsigned m_sqPending;
+
+  unsigned* m_cqHead;
+  unsigned* m_cqTail;
+  unsigned m_cqMask;
+  io_uring_cqe* m_cqes;
+
+  io_uring_buf_ring* m_bufRing;
+  size_t m_bufRingSize;
+  unsigned m_bufRingMask;
+  unsigned short m_bufGroup;
+  unsigned char* m_bufs;
+  unsigned m_bufSize;
+};
+
+class IoUringException : public std::exception {
+public:
+  IoUringException(const std::string& cause)
+    :m_cause(cause)
+  {}
+
+  virtual const char* what() const noexcept(true)
+  {
+    return m_cause.c_str();
+  }
+
+  virtual ~IoUringException()
+  {}
+
+protected:
+  std::string m_cause;
+};
+
+#endif
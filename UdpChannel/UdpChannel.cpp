@@ -15,17 +15,30 @@
  */
 
 #include "UdpChannel.h"
+#include "IoUring.h"
 #include "IqrfLogging.h"
 
 #include "PlatformDep.h"
 #include <stdlib.h>     //srand, rand
 #include <time.h>       //time
 #include <string.h>
+#include <algorithm>
+
+#ifndef WIN
+#include <pthread.h>
+#include <poll.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/eventfd.h>
+#endif
 
 #ifndef WIN
 #define WSAGetLastError() errno
 #define SOCKET_ERROR -1
-int closesocket(int filedes) { close(filedes); }
+int closesocket(int filedes) { return close(filedes); }
 typedef int opttype;
 #else
 #define SHUT_RD SD_RECEIVE
@@ -33,13 +46,90 @@ typedef char opttype;
 #endif
 
 UdpChannel::UdpChannel(unsigned short remotePort, unsigned short localPort, unsigned bufsize)
-  :m_runListenThread(true),
-  m_remotePort(remotePort),
+  :UdpChannel(remotePort, localPort, bufsize, Config())
+{
+}
+
+UdpChannel::UdpChannel(unsigned short remotePort, unsigned short localPort, unsigned bufsize, const Config& cfg)
+  :m_remotePort(remotePort),
   m_localPort(localPort),
-  m_bufsize(bufsize)
+  m_bufsize(bufsize),
+  m_recvBatchSize(cfg.recvBatchSize > 0 ? cfg.recvBatchSize : 1),
+  m_pinShards(cfg.pinShards),
+  m_rxTimestamps(cfg.rxTimestamps),
+  m_detectDrops(cfg.detectDrops),
+  m_rcvBufSize(cfg.rcvBufSize),
+  m_sndBufSize(cfg.sndBufSize),
+  m_busyPoll(cfg.busyPoll),
+  m_busyPollIdle(cfg.busyPollIdle),
+  m_busyPollBudget(cfg.busyPollBudget),
+  m_ioUring(cfg.ioUring),
+  m_ioUringEntries(cfg.ioUringEntries > 0 ? cfg.ioUringEntries : 1),
+  m_sendRing(nullptr),
+  m_runSendThread(false),
+  m_sendQueueSize(cfg.ioUringSendQueueSize > 0 ? cfg.ioUringSendQueueSize : 1),
+  m_dispatchQueue(nullptr),
+  m_controlLen(0),
+  m_maxPeers(cfg.maxPeers),
+  m_peerIdleTimeout(cfg.peerIdleTimeout),
+  m_discoveryTimeout(cfg.discoveryTimeout),
+  m_myIpAdress("0.0.0.0"),
+  m_myMacAdress("00-00-00-00-00-00")
+#ifndef WIN
+  , m_netlinkSocket(-1)
+  , m_uringWakeFd(-1)
+  , m_dumpSeq(0)
+  , m_dumpType(0)
+  , m_redumpLinks(false)
+  , m_redumpAddresses(false)
+#endif
 {
-  TRC_ENTER(PAR(remotePort) << PAR(localPort) << PAR(bufsize));
-  m_isListening = false;
+  unsigned receiveShards = cfg.receiveShards > 0 ? cfg.receiveShards : 1;
+  TRC_ENTER(PAR(remotePort) << PAR(localPort) << PAR(bufsize) << PAR(m_recvBatchSize) << PAR(receiveShards));
+  m_listeningShards = 0;
+  m_runListenThread = true;
+  m_received = 0;
+  m_receiveCalls = 0;
+  m_sent = 0;
+  m_peersCount = 0;
+  m_peersExpired = 0;
+  m_peersEvicted = 0;
+  m_runSweepThread = false;
+  m_kernelDrops = 0;
+  m_busyPollFallbacks = 0;
+  m_sendErrors = 0;
+  m_sendBatches = 0;
+  m_sendQueueFull = 0;
+  m_sendUringActive = false;
+
+  // provided buffer ring and SQ sizes must be powers of 2
+  if (cfg.ioUring && (m_ioUringEntries & (m_ioUringEntries - 1)) != 0) {
+    THROW_EX(UdpChannelException, "ioUringEntries is not a power of 2: " << PAR(m_ioUringEntries));
+  }
+
+#ifdef WIN
+  // batches are read by recvmmsg() and shards use SO_REUSEPORT not available here
+  m_recvBatchSize = 1;
+  receiveShards = 1;
+  m_rxTimestamps = false;
+  m_detectDrops = false;
+  m_busyPoll = false;
+  m_ioUring = false;
+#else
+#ifndef HAVE_IO_URING
+  if (m_ioUring) {
+    TRC_WAR("io_uring not supported by the build, using recvmmsg and sendto");
+    m_ioUring = false;
+  }
+#endif
+  // ancillary data space per datagram
+  if (m_rxTimestamps) {
+    m_controlLen += CMSG_SPACE(sizeof(struct timespec));
+  }
+  if (m_detectDrops) {
+    m_controlLen += CMSG_SPACE(sizeof(uint32_t));
+  }
+#endif
 
 #ifdef WIN
   // Initialize Winsock
@@ -52,131 +142,1058 @@ UdpChannel::UdpChannel(unsigned short remotePort, unsigned short localPort, unsi
   }
 #endif
 
-  //try to get local IP by trm and rec to itself
-  getMyAddress();
-  TRC_INF("UDP listening on: " <<
-    NAME_PAR(IP, m_myIpAdress) << NAME_PAR(port, localPort) << NAME_PAR(MAC, m_myMacAdress));
+  if (!cfg.deferDiscovery) {
+    discover();
+  }
+
+  // Remote server, packets are send as a broadcast until the first packet is received
+  m_iqrfUdpTalkerAddr = htonl(INADDR_BROADCAST);
+
+  // everything that may fail is opened before threads start
+  m_shards.resize(receiveShards);
+  try {
+#ifdef HAVE_IO_URING
+    if (m_ioUring) {
+      m_uringWakeFd = eventfd(0, EFD_CLOEXEC);
+      if (m_uringWakeFd == -1) {
+        THROW_EX(UdpChannelException, "eventfd failed: " << GetLastError());
+      }
+    }
+#endif
+    for (auto& shard : m_shards) {
+      shard.mSocket = openSocket(receiveShards > 1);
+    }
+#ifndef WIN
+    if (cfg.trackAddressChanges) {
+      openNetlink();
+    }
+#endif
+  }
+  catch (UdpChannelException&) {
+    closeShards();
+#ifndef WIN
+    if (m_uringWakeFd != -1) {
+      close(m_uringWakeFd);
+    }
+#endif
+    throw;
+  }
+  m_iqrfUdpSocket = m_shards[0].mSocket;
+
+  for (auto& shard : m_shards) {
+    // ring of receive buffers, one per datagram in batch
+    shard.mRx = ant_new unsigned char[m_bufsize * m_recvBatchSize];
+    memset(shard.mRx, 0, m_bufsize * m_recvBatchSize);
+
+#ifndef WIN
+    shard.mMsgs.resize(m_recvBatchSize);
+    shard.mIovs.resize(m_recvBatchSize);
+    shard.mFroms.resize(m_recvBatchSize);
+    shard.mControl.resize(m_recvBatchSize * m_controlLen);
+    for (unsigned i = 0; i < m_recvBatchSize; i++) {
+      shard.mIovs[i].iov_base = shard.mRx + i * m_bufsize;
+      shard.mIovs[i].iov_len = m_bufsize;
+      memset(&shard.mMsgs[i], 0, sizeof(mmsghdr));
+      shard.mMsgs[i].msg_hdr.msg_iov = &shard.mIovs[i];
+      shard.mMsgs[i].msg_hdr.msg_iovlen = 1;
+      shard.mMsgs[i].msg_hdr.msg_name = &shard.mFroms[i];
+    }
+#endif
+  }
+
+  if (cfg.dispatchQueueSize > 0) {
+    m_dispatchQueue = ant_new TaskQueue<DispatchItem>([this](DispatchItem&& item) {
+      dispatchTimed(item.mBatch, item.mInfos);
+    }, cfg.dispatchQueueSize, cfg.dispatchDropPolicy);
+  }
+
+  for (auto& shard : m_shards) {
+    shard.mListenThread = std::thread(&UdpChannel::listen, this, &shard);
+  }
+
+  if (m_peerIdleTimeout.count() > 0) {
+    m_runSweepThread = true;
+    m_sweepThread = std::thread(&UdpChannel::sweepPeers, this);
+  }
+
+#ifdef HAVE_IO_URING
+  if (m_ioUring) {
+    try {
+      m_sendRing = ant_new IoUring(m_ioUringEntries);
+      m_runSendThread = true;
+      m_sendUringActive = true;
+      m_sendThread = std::thread(&UdpChannel::sendUring, this);
+    }
+    catch (IoUringException& e) {
+      CATCH_EX("io_uring send not available, using sendto", IoUringException, e);
+    }
+  }
+#endif
+
+#ifndef WIN
+  if (cfg.trackAddressChanges) {
+    m_netlinkThread = std::thread(&UdpChannel::watchNetlink, this);
+  }
+#endif
+
+  if (cfg.deferDiscovery) {
+    m_discoveryThread = std::thread([this] {
+      try {
+        discover();
+      }
+      catch (UdpChannelException& e) {
+        CATCH_EX("deferred discovery failed", UdpChannelException, e);
+      }
+    });
+  }
+  TRC_LEAVE("");
+}
+
+UdpChannel::~UdpChannel()
+{
+  if (m_sendThread.joinable()) {
+    // queued datagrams are sent before the thread stops, late ones go by sendto
+    {
+      std::unique_lock<std::mutex> lck(m_sendMtx);
+      m_sendUringActive = false;
+      m_runSendThread = false;
+    }
+    m_sendCondition.notify_all();
+    TRC_DBG("joining udp send thread");
+    m_sendThread.join();
+    TRC_DBG("send thread joined");
+  }
+#ifdef HAVE_IO_URING
+  delete m_sendRing;
+#endif
+
+  if (m_sweepThread.joinable()) {
+    {
+      std::unique_lock<std::mutex> lck(m_sweepMtx);
+      m_runSweepThread = false;
+    }
+    m_sweepCondition.notify_all();
+    m_sweepThread.join();
+  }
+
+  m_runListenThread = false;
+  closeShards();
+#ifndef WIN
+  if (m_uringWakeFd != -1) {
+    close(m_uringWakeFd);
+  }
+#endif
+  // handlers may still be running from the dispatch thread
+  delete m_dispatchQueue;
 
+  if (m_discoveryThread.joinable())
+    m_discoveryThread.join();
+
+#ifndef WIN
+  if (m_netlinkSocket != -1) {
+    char c = 0;
+    if (write(m_netlinkWakeFd[1], &c, 1) < 0) {
+      TRC_WAR("wake up write failed: " << GetLastError());
+    }
+    TRC_DBG("joining netlink thread");
+    if (m_netlinkThread.joinable())
+      m_netlinkThread.join();
+    TRC_DBG("netlink thread joined");
+    close(m_netlinkWakeFd[0]);
+    close(m_netlinkWakeFd[1]);
+    close(m_netlinkSocket);
+  }
+#endif
+
+#ifdef WIN
+  WSACleanup();
+#endif
+}
+
+SOCKET UdpChannel::openSocket(bool reusePort)
+{
   //iqrfUdpSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
-  m_iqrfUdpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-  if (m_iqrfUdpSocket == -1)
+  SOCKET soc = socket(AF_INET, SOCK_DGRAM, 0);
+  if (soc == -1)
     THROW_EX(UdpChannelException, "socket failed: " << GetLastError());
 
   opttype broadcastEnable = 1;                                // Enable sending broadcast packets
-  if (0 != setsockopt(m_iqrfUdpSocket, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)))
+  if (0 != setsockopt(soc, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)))
   {
-    closesocket(m_iqrfUdpSocket);
+    closesocket(soc);
     THROW_EX(UdpChannelException, "setsockopt failed: " << GetLastError());
   }
 
-  // Remote server, packets are send as a broadcast until the first packet is received
-  memset(&m_iqrfUdpTalker, 0, sizeof(m_iqrfUdpTalker));
-  m_iqrfUdpTalker.sin_family = AF_INET;
-  m_iqrfUdpTalker.sin_port = htons(m_remotePort);
-  m_iqrfUdpTalker.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+  if (m_rcvBufSize > 0) {
+    setBufSize(soc, SO_RCVBUF, m_rcvBufSize);
+  }
+  if (m_sndBufSize > 0) {
+    setBufSize(soc, SO_SNDBUF, m_sndBufSize);
+  }
+
+#ifndef WIN
+  if (m_detectDrops) {
+    // number of datagrams dropped by the socket passed as ancillary data
+    opttype dropsEnable = 1;
+    if (0 != setsockopt(soc, SOL_SOCKET, SO_RXQ_OVFL, &dropsEnable, sizeof(dropsEnable)))
+    {
+      closesocket(soc);
+      THROW_EX(UdpChannelException, "setsockopt SO_RXQ_OVFL failed: " << GetLastError());
+    }
+  }
+
+  if (m_rxTimestamps) {
+    // kernel receive time passed as ancillary data
+    opttype timestampEnable = 1;
+    if (0 != setsockopt(soc, SOL_SOCKET, SO_TIMESTAMPNS, &timestampEnable, sizeof(timestampEnable)))
+    {
+      closesocket(soc);
+      THROW_EX(UdpChannelException, "setsockopt SO_TIMESTAMPNS failed: " << GetLastError());
+    }
+  }
+
+  if (m_busyPoll && m_busyPollBudget.count() > 0) {
+    // the kernel polls the device queue in the receive call instead of waiting for the interrupt
+    // values above net.core.busy_read require CAP_NET_ADMIN, spinning works without it
+    opttype busyPollUs = (opttype)m_busyPollBudget.count();
+    if (0 != setsockopt(soc, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof(busyPollUs)))
+    {
+      TRC_WAR("setsockopt SO_BUSY_POLL failed: " << GetLastError());
+    }
+  }
+
+  if (reusePort) {
+    // the kernel spreads incoming datagrams among the sockets by source address hash
+    opttype reusePortEnable = 1;
+    if (0 != setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &reusePortEnable, sizeof(reusePortEnable)))
+    {
+      closesocket(soc);
+      THROW_EX(UdpChannelException, "setsockopt SO_REUSEPORT failed: " << GetLastError());
+    }
+  }
+#endif
 
   // Local server, packets are received from any IP
-  memset(&m_iqrfUdpListener, 0, sizeof(m_iqrfUdpListener));
-  m_iqrfUdpListener.sin_family = AF_INET;
-  m_iqrfUdpListener.sin_port = htons(m_localPort);
-  m_iqrfUdpListener.sin_addr.s_addr = htonl(INADDR_ANY);
+  sockaddr_in iqrfUdpListener;
+  memset(&iqrfUdpListener, 0, sizeof(iqrfUdpListener));
+  iqrfUdpListener.sin_family = AF_INET;
+  iqrfUdpListener.sin_port = htons(m_localPort);
+  iqrfUdpListener.sin_addr.s_addr = htonl(INADDR_ANY);
 
-  if (SOCKET_ERROR == bind(m_iqrfUdpSocket, (struct sockaddr *)&m_iqrfUdpListener, sizeof(m_iqrfUdpListener)))
+  if (SOCKET_ERROR == bind(soc, (struct sockaddr *)&iqrfUdpListener, sizeof(iqrfUdpListener)))
   {
-    closesocket(m_iqrfUdpSocket);
+    closesocket(soc);
     THROW_EX(UdpChannelException, "bind failed: " << GetLastError());
   }
 
-  m_rx = ant_new unsigned char[m_bufsize];
-  memset(m_rx, 0, m_bufsize);
-
-  m_listenThread = std::thread(&UdpChannel::listen, this);
-  TRC_LEAVE("");
+  return soc;
 }
 
-UdpChannel::~UdpChannel()
+void UdpChannel::setBufSize(SOCKET soc, int option, int size)
 {
-  shutdown(m_iqrfUdpSocket, SHUT_RD);
-  closesocket(m_iqrfUdpSocket);
+  opttype* value = (opttype*)&size;
+  int res = -1;
+#ifndef WIN
+  // privileged variant ignores net.core.rmem_max/wmem_max
+  int forceOption = option == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+  res = setsockopt(soc, SOL_SOCKET, forceOption, value, sizeof(size));
+#endif
+  if (res != 0) {
+    res = setsockopt(soc, SOL_SOCKET, option, value, sizeof(size));
+  }
 
-  TRC_DBG("joining udp listening thread");
-  if (m_listenThread.joinable())
-    m_listenThread.join();
-  TRC_DBG("listening thread joined");
+  int actual = 0;
+  socklen_t actualLength = sizeof(actual);
+  getsockopt(soc, SOL_SOCKET, option, (opttype*)&actual, &actualLength);
+  if (res != 0 || actual < size) {
+    TRC_WAR("Socket buffer size limited: " << PAR(option) << NAME_PAR(required, size) << PAR(actual));
+  }
+  else {
+    TRC_DBG("Socket buffer size set: " << PAR(option) << NAME_PAR(required, size) << PAR(actual));
+  }
+}
 
-#ifdef WIN
-  WSACleanup();
+void UdpChannel::closeShards()
+{
+#ifndef WIN
+  if (m_uringWakeFd != -1) {
+    // shutdown doesn't end multishot receive, io_uring listen threads poll the eventfd
+    uint64_t one = 1;
+    if (write(m_uringWakeFd, &one, sizeof(one)) < 0) {
+      TRC_WAR("wake up write failed: " << GetLastError());
+    }
+  }
 #endif
 
-  delete[] m_rx;
+  for (auto& shard : m_shards) {
+    if (shard.mSocket != -1) {
+      shutdown(shard.mSocket, SHUT_RD);
+      closesocket(shard.mSocket);
+    }
+  }
+
+  TRC_DBG("joining udp listening threads");
+  for (auto& shard : m_shards) {
+    if (shard.mListenThread.joinable())
+      shard.mListenThread.join();
+    delete[] shard.mRx;
+  }
+  TRC_DBG("listening threads joined");
+
+  m_shards.clear();
 }
 
-void UdpChannel::listen()
+void UdpChannel::listen(Shard* shard)
 {
   TRC_ENTER("thread starts");
 
   int recn = -1;
-  socklen_t iqrfUdpListenerLength = sizeof(m_iqrfUdpListener);
+  std::vector<std::basic_string<unsigned char>> batch;
+  std::vector<PacketInfo> infos;
+  batch.reserve(m_recvBatchSize);
+  infos.reserve(m_recvBatchSize);
+
+#ifndef WIN
+  if (m_pinShards) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    unsigned cpu = (unsigned)(shard - m_shards.data()) % (cpus > 0 ? cpus : 1);
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (res != 0) {
+      TRC_WAR("pthread_setaffinity_np failed: " << PAR(cpu) << PAR(res));
+    }
+  }
+#endif
+
+#ifdef HAVE_IO_URING
+  if (m_ioUring && listenUring(shard)) {
+    TRC_LEAVE("thread stopped");
+    return;
+  }
+#endif
+
+#ifndef WIN
+  // busy polling spins while datagrams keep coming and sleeps in the kernel after busyPollIdle
+  bool spinning = m_busyPoll;
+  auto lastReceived = std::chrono::steady_clock::now();
+#endif
 
   try {
-    m_isListening = true;
+    m_listeningShards++;
     while (m_runListenThread)
     {
-      recn = recvfrom(m_iqrfUdpSocket, (char*)m_rx, m_bufsize, 0, (struct sockaddr *)&m_iqrfUdpListener, &iqrfUdpListenerLength);
+      batch.clear();
+      infos.clear();
+#ifndef WIN
+      for (unsigned i = 0; i < m_recvBatchSize; i++) {
+        shard->mMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        if (m_controlLen > 0) {
+          shard->mMsgs[i].msg_hdr.msg_control = &shard->mControl[i * m_controlLen];
+          shard->mMsgs[i].msg_hdr.msg_controllen = m_controlLen;
+        }
+      }
+
+      // blocks for the first datagram only, then takes what is already queued
+      int flags = MSG_WAITFORONE;
+      if (spinning) {
+        flags |= MSG_DONTWAIT;
+      }
+      recn = recvmmsg(shard->mSocket, shard->mMsgs.data(), m_recvBatchSize, flags, NULL);
+
+      if (recn == SOCKET_ERROR) {
+        if (errno == EINTR)
+          continue;
+        if (spinning && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          if (std::chrono::steady_clock::now() - lastReceived > m_busyPollIdle) {
+            spinning = false;
+            m_busyPollFallbacks++;
+          }
+          else {
+            // let other runnable threads go if the core is shared
+            std::this_thread::yield();
+          }
+          continue;
+        }
+        THROW_EX(UdpChannelException, "recvmmsg returned: " << WSAGetLastError());
+      }
+      m_receiveCalls++;
+
+      if (m_busyPoll) {
+        spinning = true;
+        lastReceived = std::chrono::steady_clock::now();
+      }
+
+      struct timespec now;
+      memset(&now, 0, sizeof(now));
+      if (m_rxTimestamps) {
+        clock_gettime(CLOCK_REALTIME, &now);
+      }
+
+      for (int i = 0; i < recn; i++) {
+        if (shard->mMsgs[i].msg_len > 0) {
+          batch.push_back(std::basic_string<unsigned char>((unsigned char*)shard->mIovs[i].iov_base, shard->mMsgs[i].msg_len));
+          PacketInfo info;
+          info.from = shard->mFroms[i];
+          info.kernelTime = std::chrono::nanoseconds(0);
+          info.queueDelay = std::chrono::nanoseconds(0);
+          if (m_controlLen > 0) {
+            processControl(shard, shard->mMsgs[i].msg_hdr, now, info);
+          }
+          infos.push_back(info);
+        }
+      }
+#else
+      sockaddr_in from;
+      socklen_t fromLength = sizeof(from);
+      recn = recvfrom(shard->mSocket, (char*)shard->mRx, m_bufsize, 0, (struct sockaddr *)&from, &fromLength);
 
       if (recn == SOCKET_ERROR) {
         THROW_EX(UdpChannelException, "recvfrom returned: " << WSAGetLastError());
       }
+      m_receiveCalls++;
 
       if (recn > 0) {
-        if (m_receiveFromFunc) {
-          std::basic_string<unsigned char> message(m_rx, recn);
-          if (0 == m_receiveFromFunc(message)) {
-            m_iqrfUdpTalker.sin_addr.s_addr = m_iqrfUdpListener.sin_addr.s_addr;    // Change the destination to the address of the last received packet
+        batch.push_back(std::basic_string<unsigned char>(shard->mRx, recn));
+        PacketInfo info;
+        info.from = from;
+        info.kernelTime = std::chrono::nanoseconds(0);
+        info.queueDelay = std::chrono::nanoseconds(0);
+        infos.push_back(info);
+      }
+#endif
+
+      if (!batch.empty()) {
+        deliver(batch, infos);
+      }
+    }
+  }
+  catch (UdpChannelException& e) {
+    CATCH_EX("listening thread finished", UdpChannelException, e);
+  }
+  m_listeningShards--;
+  TRC_LEAVE("thread stopped");
+}
+
+#ifdef HAVE_IO_URING
+bool UdpChannel::listenUring(Shard* shard)
+{
+  // recvmsg template of the multishot request, name and control area are reserved in each buffer
+  msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_namelen = sizeof(sockaddr_in);
+  hdr.msg_controllen = m_controlLen;
+  size_t nameOffset = sizeof(io_uring_recvmsg_out);
+  size_t controlOffset = nameOffset + hdr.msg_namelen;
+  size_t payloadOffset = controlOffset + hdr.msg_controllen;
+  size_t bufSize = payloadOffset + m_bufsize;
+
+  IoUring* ring = nullptr;
+  std::vector<unsigned char> bufs(bufSize * m_ioUringEntries);
+  try {
+    ring = ant_new IoUring(m_ioUringEntries);
+    ring->registerBufRing(0, m_ioUringEntries, bufs.data(), (unsigned)bufSize);
+  }
+  catch (IoUringException& e) {
+    CATCH_EX("io_uring receive not available, using recvmmsg", IoUringException, e);
+    delete ring;
+    return false;
+  }
+
+  std::vector<std::basic_string<unsigned char>> batch;
+  std::vector<PacketInfo> infos;
+  batch.reserve(m_ioUringEntries);
+  infos.reserve(m_ioUringEntries);
+
+  // request tags
+  const uint64_t RECV = 0;
+  const uint64_t WAKE = 1;
+
+  io_uring_sqe* sqe = ring->getSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = m_uringWakeFd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = WAKE;
+
+  bool rearm = true;
+  bool supported = false;
+  bool unsupported = false;
+
+  try {
+    m_listeningShards++;
+    while (m_runListenThread && !unsupported)
+    {
+      if (rearm) {
+        // one request delivers datagrams until it runs out of buffers
+        sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = shard->mSocket;
+        sqe->addr = (uint64_t)(uintptr_t)&hdr;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = RECV;
+        rearm = false;
+      }
+
+      int res = ring->submit(1);
+      if (res < 0) {
+        if (res == -EINTR)
+          continue;
+        THROW_EX(UdpChannelException, "io_uring_enter returned: " << -res);
+      }
+      m_receiveCalls++;
+
+      struct timespec now;
+      memset(&now, 0, sizeof(now));
+      if (m_rxTimestamps) {
+        clock_gettime(CLOCK_REALTIME, &now);
+      }
+
+      batch.clear();
+      infos.clear();
+      io_uring_cqe* cqe;
+      while ((cqe = ring->peekCqe()) != nullptr) {
+        int cres = cqe->res;
+        unsigned cflags = cqe->flags;
+        uint64_t tag = cqe->user_data;
+        ring->cqeSeen();
+
+        if (tag == WAKE) {
+          // closeShards() called, the loop ends on m_runListenThread
+          continue;
+        }
+
+        if (!(cflags & IORING_CQE_F_MORE)) {
+          rearm = true;
+        }
+        if (cres < 0) {
+          if (cres == -ENOBUFS) {
+            // all buffers taken, they are returned below before the request is re-armed
+            continue;
           }
+          if (!supported && cres == -EINVAL) {
+            TRC_WAR("multishot recvmsg not supported by kernel, using recvmmsg");
+            unsupported = true;
+            break;
+          }
+          THROW_EX(UdpChannelException, "io_uring recvmsg returned: " << -cres);
         }
-        else {
-          TRC_WAR("Unregistered receiveFrom() handler");
+        supported = true;
+        if (!(cflags & IORING_CQE_F_BUFFER)) {
+          continue;
+        }
+
+        unsigned short bid = (unsigned short)(cflags >> IORING_CQE_BUFFER_SHIFT);
+        unsigned char* buf = ring->getBuf(bid);
+        io_uring_recvmsg_out* out = (io_uring_recvmsg_out*)buf;
+        size_t len = std::min((size_t)out->payloadlen, (size_t)m_bufsize);
+        if (len > 0) {
+          batch.push_back(std::basic_string<unsigned char>(buf + payloadOffset, len));
+          PacketInfo info;
+          memset(&info.from, 0, sizeof(info.from));
+          memcpy(&info.from, buf + nameOffset, std::min((size_t)out->namelen, sizeof(info.from)));
+          info.kernelTime = std::chrono::nanoseconds(0);
+          info.queueDelay = std::chrono::nanoseconds(0);
+          if (m_controlLen > 0) {
+            msghdr control;
+            memset(&control, 0, sizeof(control));
+            control.msg_control = buf + controlOffset;
+            control.msg_controllen = out->controllen;
+            processControl(shard, control, now, info);
+          }
+          infos.push_back(info);
         }
+        ring->returnBuf(bid);
+      }
+
+      if (!batch.empty()) {
+        deliver(batch, infos);
       }
     }
   }
   catch (UdpChannelException& e) {
     CATCH_EX("listening thread finished", UdpChannelException, e);
-    m_runListenThread = false;
   }
-  m_isListening = false;
+  m_listeningShards--;
+  delete ring;
+  return !unsupported;
+}
+
+void UdpChannel::sendUring()
+{
+  TRC_ENTER("thread starts");
+
+  std::vector<SendItem> inflight;
+  std::vector<msghdr> hdrs(m_ioUringEntries);
+  std::vector<iovec> iovs(m_ioUringEntries);
+  inflight.reserve(m_ioUringEntries);
+
+  try {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lck(m_sendMtx);
+        m_sendCondition.wait(lck, [&] { return !m_sendQueue.empty() || !m_runSendThread; });
+        if (m_sendQueue.empty())
+          break;
+        // everything queued while the previous batch was in flight goes in one submission
+        while (!m_sendQueue.empty() && inflight.size() < m_ioUringEntries) {
+          inflight.push_back(std::move(m_sendQueue.front()));
+          m_sendQueue.pop_front();
+        }
+      }
+
+      unsigned count = (unsigned)inflight.size();
+      for (unsigned i = 0; i < count; i++) {
+        iovs[i].iov_base = (void*)inflight[i].mMsg.data();
+        iovs[i].iov_len = inflight[i].mMsg.size();
+        memset(&hdrs[i], 0, sizeof(msghdr));
+        hdrs[i].msg_name = &inflight[i].mTo;
+        hdrs[i].msg_namelen = sizeof(sockaddr_in);
+        hdrs[i].msg_iov = &iovs[i];
+        hdrs[i].msg_iovlen = 1;
+
+        io_uring_sqe* sqe = m_sendRing->getSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = m_iqrfUdpSocket;
+        sqe->addr = (uint64_t)(uintptr_t)&hdrs[i];
+        sqe->len = 1;
+        sqe->user_data = i;
+      }
+
+      unsigned done = 0;
+      int res = m_sendRing->submit(count);
+      while (done < count) {
+        if (res < 0 && res != -EINTR) {
+          THROW_EX(UdpChannelException, "io_uring_enter returned: " << -res);
+        }
+        io_uring_cqe* cqe = m_sendRing->peekCqe();
+        if (cqe == nullptr) {
+          res = m_sendRing->submit(count - done);
+          continue;
+        }
+        if (cqe->res < 0) {
+          TRC_WAR("io_uring sendmsg failed: " << NAME_PAR(error, -cqe->res));
+          m_sendErrors++;
+        }
+        else {
+          m_sent++;
+        }
+        m_sendRing->cqeSeen();
+        done++;
+      }
+      m_sendBatches++;
+      inflight.clear();
+    }
+  }
+  catch (UdpChannelException& e) {
+    CATCH_EX("io_uring send failed, using sendto", UdpChannelException, e);
+    // the datagrams of the failed batch are lost, the rest is sent the usual way
+    m_sendErrors += inflight.size();
+    std::deque<SendItem> queue;
+    {
+      std::unique_lock<std::mutex> lck(m_sendMtx);
+      m_sendUringActive = false;
+      queue.swap(m_sendQueue);
+    }
+    for (auto& item : queue) {
+      if (0 > sendto(m_iqrfUdpSocket, (const char*)item.mMsg.data(), item.mMsg.size(), 0, (struct sockaddr *)&item.mTo, sizeof(item.mTo))) {
+        m_sendErrors++;
+      }
+      else {
+        m_sent++;
+      }
+    }
+  }
   TRC_LEAVE("thread stopped");
 }
+#endif
+
+void UdpChannel::deliver(std::vector<std::basic_string<unsigned char>>& batch, std::vector<PacketInfo>& infos)
+{
+  m_received += batch.size();
+  updatePeers(infos);
+  if (m_dispatchQueue) {
+    // handlers can't stall reading, the queue drops if they don't keep up
+    DispatchItem item;
+    item.mBatch = std::move(batch);
+    item.mInfos = std::move(infos);
+    m_dispatchQueue->pushToQueue(std::move(item));
+  }
+  else {
+    dispatchTimed(batch, infos);
+  }
+}
+
+void UdpChannel::dispatchTimed(const std::vector<std::basic_string<unsigned char>>& batch, const std::vector<PacketInfo>& infos)
+{
+  if (m_rxTimestamps) {
+    auto start = std::chrono::steady_clock::now();
+    dispatch(batch, infos);
+    m_handlerTime.add(std::chrono::steady_clock::now() - start);
+  }
+  else {
+    dispatch(batch, infos);
+  }
+}
+
+void UdpChannel::dispatch(const std::vector<std::basic_string<unsigned char>>& batch, const std::vector<PacketInfo>& infos)
+{
+  // handlers are checked in order of precedence, the next one is read only if the previous is unset
+  HandlerSlot<ReceivePacketFunc>::Reader receivePacketFunc(m_receivePacketFunc);
+  if (receivePacketFunc) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (0 == (*receivePacketFunc)(batch[i], infos[i])) {
+        m_iqrfUdpTalkerAddr = infos[i].from.sin_addr.s_addr;    // Change the destination to the address of the last received packet
+      }
+    }
+    return;
+  }
+
+  HandlerSlot<ReceiveFromPeerFunc>::Reader receiveFromPeerFunc(m_receiveFromPeerFunc);
+  if (receiveFromPeerFunc) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (0 == (*receiveFromPeerFunc)(batch[i], infos[i].from)) {
+        m_iqrfUdpTalkerAddr = infos[i].from.sin_addr.s_addr;    // Change the destination to the address of the last received packet
+      }
+    }
+    return;
+  }
+
+  HandlerSlot<ReceiveBatchFunc>::Reader receiveBatchFunc(m_receiveBatchFunc);
+  if (receiveBatchFunc) {
+    if (0 == (*receiveBatchFunc)(batch)) {
+      m_iqrfUdpTalkerAddr = infos.back().from.sin_addr.s_addr;    // Change the destination to the address of the last received packet
+    }
+    return;
+  }
+
+  HandlerSlot<ReceiveFromFunc>::Reader receiveFromFunc(m_receiveFromFunc);
+  if (receiveFromFunc) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (0 == (*receiveFromFunc)(batch[i])) {
+        m_iqrfUdpTalkerAddr = infos[i].from.sin_addr.s_addr;    // Change the destination to the address of the last received packet
+      }
+    }
+    return;
+  }
+
+  TRC_WAR("Unregistered receiveFrom() handler");
+}
 
 void UdpChannel::sendTo(const std::basic_string<unsigned char>& message)
 {
   //TRC_DBG("Send to UDP: " << std::endl << FORM_HEX(message.data(), message.size()));
 
-  int trmn = sendto(m_iqrfUdpSocket, (const char*)message.data(), message.size(), 0, (struct sockaddr *)&m_iqrfUdpTalker, sizeof(m_iqrfUdpTalker));
+  // Remote server
+  sockaddr_in iqrfUdpTalker;
+  memset(&iqrfUdpTalker, 0, sizeof(iqrfUdpTalker));
+  iqrfUdpTalker.sin_family = AF_INET;
+  iqrfUdpTalker.sin_port = htons(m_remotePort);
+  iqrfUdpTalker.sin_addr.s_addr = m_iqrfUdpTalkerAddr;
+
+  sendTo(iqrfUdpTalker, message);
+}
+
+void UdpChannel::sendTo(const sockaddr_in& peer, const std::basic_string<unsigned char>& message)
+{
+  if (m_sendUringActive) {
+    std::unique_lock<std::mutex> lck(m_sendMtx);
+    // checked again, the send thread may have stopped meanwhile
+    if (m_sendUringActive) {
+      if (m_sendQueue.size() >= m_sendQueueSize) {
+        m_sendQueueFull++;
+        THROW_EX(UdpChannelException, "io_uring send queue full: " << PAR(m_sendQueueSize));
+      }
+      SendItem item;
+      item.mTo = peer;
+      item.mMsg = message;
+      m_sendQueue.push_back(std::move(item));
+      lck.unlock();
+      m_sendCondition.notify_one();
+      return;
+    }
+  }
+
+  int trmn = sendto(m_iqrfUdpSocket, (const char*)message.data(), message.size(), 0, (struct sockaddr *)&peer, sizeof(peer));
 
   if (trmn < 0) {
     THROW_EX(UdpChannelException, "sendto failed: " << WSAGetLastError());
   }
+  m_sent++;
+}
 
+#ifndef WIN
+void UdpChannel::processControl(Shard* shard, const msghdr& hdr, const struct timespec& now, PacketInfo& info)
+{
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR((msghdr*)&hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      // the socket drop counter is cumulative
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      if (drops != shard->mKernelDrops) {
+        TRC_WAR("UDP datagrams dropped by kernel: " << NAME_PAR(drops, drops - shard->mKernelDrops));
+        m_kernelDrops += (uint32_t)(drops - shard->mKernelDrops);
+        shard->mKernelDrops = drops;
+      }
+    }
+    else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      info.kernelTime = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+      info.queueDelay = std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec) - info.kernelTime;
+      m_queueDelay.add(info.queueDelay);
+    }
+  }
+}
+#endif
+
+inline uint64_t peerKey(const sockaddr_in& peer)
+{
+  return ((uint64_t)peer.sin_addr.s_addr << 16) | peer.sin_port;
+}
+
+inline unsigned peerTablePart(uint64_t key, unsigned parts)
+{
+  // multiplicative hash, the key itself has zero low bits for the same port
+  return (unsigned)((key * 0x9E3779B97F4A7C15ull) >> 32) % parts;
+}
+
+void UdpChannel::updatePeers(const std::vector<PacketInfo>& infos)
+{
+  auto now = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lck;
+  PeerTablePart* part = nullptr;
+
+  for (const auto& info : infos) {
+    const sockaddr_in& from = info.from;
+    uint64_t key = peerKey(from);
+
+    // datagrams of a batch come mostly from the same peer, its part stays locked
+    // only one part is locked at a time, the receive shards would deadlock on two parts otherwise
+    PeerTablePart* next = &m_peerTable[peerTablePart(key, PEER_TABLE_PARTS)];
+    if (next != part) {
+      if (lck.owns_lock())
+        lck.unlock();
+      part = next;
+      lck = std::unique_lock<std::mutex>(part->mMtx);
+    }
+
+    auto found = part->mPeers.find(key);
+    if (found == part->mPeers.end()) {
+      if (m_maxPeers > 0 && m_peersCount >= m_maxPeers) {
+        if (part->mPeers.empty()) {
+          // the table is full of peers of other parts, the new one isn't tracked
+          m_peersEvicted++;
+          continue;
+        }
+        auto oldest = part->mPeers.begin();
+        for (auto it = part->mPeers.begin(); it != part->mPeers.end(); ++it) {
+          if (it->second.mLastSeen < oldest->second.mLastSeen)
+            oldest = it;
+        }
+        TRC_INF("UDP peer evicted: " << NAME_PAR(IP, inet_ntoa(oldest->second.mAddr.sin_addr)) << NAME_PAR(port, ntohs(oldest->second.mAddr.sin_port)));
+        part->mPeers.erase(oldest);
+        m_peersCount--;
+        m_peersEvicted++;
+      }
+      found = part->mPeers.insert(std::make_pair(key, Peer())).first;
+      found->second.mAddr = from;
+      found->second.mReceived = 0;
+      m_peersCount++;
+      TRC_INF("New UDP peer: " << NAME_PAR(IP, inet_ntoa(from.sin_addr)) << NAME_PAR(port, ntohs(from.sin_port)));
+    }
+    found->second.mLastSeen = now;
+    found->second.mReceived++;
+  }
+}
+
+void UdpChannel::sweepPeers()
+{
+  TRC_ENTER("thread starts");
+
+  std::unique_lock<std::mutex> sweepLck(m_sweepMtx);
+  while (m_runSweepThread) {
+    // peers are removed at most half of the timeout late, getPeers() filters them meanwhile
+    m_sweepCondition.wait_for(sweepLck, m_peerIdleTimeout / 2);
+    if (!m_runSweepThread)
+      break;
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto& part : m_peerTable) {
+      std::lock_guard<std::mutex> lck(part.mMtx);
+      for (auto it = part.mPeers.begin(); it != part.mPeers.end(); ) {
+        if (now - it->second.mLastSeen > m_peerIdleTimeout) {
+          TRC_INF("UDP peer expired: " << NAME_PAR(IP, inet_ntoa(it->second.mAddr.sin_addr)) << NAME_PAR(port, ntohs(it->second.mAddr.sin_port)));
+          it = part.mPeers.erase(it);
+          m_peersCount--;
+          m_peersExpired++;
+        }
+        else {
+          ++it;
+        }
+      }
+    }
+  }
+
+  TRC_LEAVE("thread stopped");
+}
+
+std::vector<sockaddr_in> UdpChannel::getPeers()
+{
+  std::vector<sockaddr_in> peers;
+  auto now = std::chrono::steady_clock::now();
+  peers.reserve(m_peersCount);
+  for (auto& part : m_peerTable) {
+    std::lock_guard<std::mutex> lck(part.mMtx);
+    for (const auto& peer : part.mPeers) {
+      if (m_peerIdleTimeout.count() == 0 || now - peer.second.mLastSeen <= m_peerIdleTimeout) {
+        peers.push_back(peer.second.mAddr);
+      }
+    }
+  }
+  return peers;
 }
 
 void UdpChannel::registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
 {
-  m_receiveFromFunc = receiveFromFunc;
+  m_receiveFromFunc.set(receiveFromFunc);
 }
 
 void UdpChannel::unregisterReceiveFromHandler()
 {
-  m_receiveFromFunc = ReceiveFromFunc();
+  m_receiveFromFunc.reset();
+}
+
+void UdpChannel::registerReceivePacketHandler(ReceivePacketFunc receivePacketFunc)
+{
+  m_receivePacketFunc.set(receivePacketFunc);
 }
 
-void UdpChannel::getMyAddress()
+void UdpChannel::unregisterReceivePacketHandler()
+{
+  m_receivePacketFunc.reset();
+}
+
+void UdpChannel::registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc)
+{
+  m_receiveFromPeerFunc.set(receiveFromPeerFunc);
+}
+
+void UdpChannel::unregisterReceiveFromPeerHandler()
+{
+  m_receiveFromPeerFunc.reset();
+}
+
+void UdpChannel::registerReceiveBatchHandler(ReceiveBatchFunc receiveBatchFunc)
+{
+  m_receiveBatchFunc.set(receiveBatchFunc);
+}
+
+void UdpChannel::unregisterReceiveBatchHandler()
+{
+  m_receiveBatchFunc.reset();
+}
+
+UdpChannel::Stats UdpChannel::getStats() const
+{
+  Stats stats;
+  stats.received = m_received;
+  stats.receiveCalls = m_receiveCalls;
+  stats.sent = m_sent;
+  stats.peers = m_peersCount;
+  stats.peersExpired = m_peersExpired;
+  stats.peersEvicted = m_peersEvicted;
+  stats.kernelDrops = m_kernelDrops;
+  stats.busyPollFallbacks = m_busyPollFallbacks;
+  stats.sendErrors = m_sendErrors;
+  stats.sendBatches = m_sendBatches;
+  stats.sendQueueFull = m_sendQueueFull;
+  stats.dispatchDropped = m_dispatchQueue ? m_dispatchQueue->getDropped() : 0;
+  stats.dispatchQueued = m_dispatchQueue ? m_dispatchQueue->size() : 0;
+  stats.queueDelay = m_queueDelay.getSnapshot();
+  stats.handlerTime = m_handlerTime.getSnapshot();
+  return stats;
+}
+
+void UdpChannel::discover()
 {
   TRC_ENTER("");
 
-  m_myIpAdress = "0.0.0.0";
-  m_myMacAdress = "00-00-00-00-00-00";
+  std::map<std::string, MyAdapter> adapters;
+  std::string ip;
+
+  getMyAdapters(adapters);
+
+  if (!getMyAddress(adapters, ip)) {
+    THROW_EX(UdpChannelException, "Failed listen myself - cannot specify my IP address.");
+  }
+
+  std::string mac("00-00-00-00-00-00");
+  auto found = adapters.find(ip);
+  if (found != adapters.end()) {
+    mac = found->second.mMac;
+  }
+
+  {
+    // merged, the netlink thread may have updated adapters meanwhile
+    std::lock_guard<std::mutex> lck(m_addressMtx);
+    m_myIpAdress = ip;
+    m_myMacAdress = mac;
+    m_adapters.insert(adapters.begin(), adapters.end());
+  }
+
+  TRC_INF("UDP listening on: " <<
+    NAME_PAR(IP, ip) << NAME_PAR(port, m_localPort) << NAME_PAR(MAC, mac));
+  TRC_LEAVE("");
+}
+
+bool UdpChannel::getMyAddress(const std::map<std::string, MyAdapter>& adapters, std::string& ip, bool probe)
+{
+  TRC_ENTER(NAME_PAR(adapters, adapters.size()));
+
+  // the only candidate needs no probing
+  if (adapters.size() == 1) {
+    ip = adapters.begin()->first;
+    TRC_LEAVE("single adapter: " << PAR(ip));
+    return true;
+  }
+
+  // source address of the default route, connect() of UDP socket doesn't send anything
+  SOCKET soc = socket(AF_INET, SOCK_DGRAM, 0);
+  if (soc != -1) {
+    sockaddr_in remote;
+    memset(&remote, 0, sizeof(remote));
+    remote.sin_family = AF_INET;
+    remote.sin_port = htons(m_remotePort);
+    remote.sin_addr.s_addr = inet_addr("8.8.8.8");
+
+    sockaddr_in local;
+    socklen_t localLength = sizeof(local);
+    // only an address of a known adapter is taken, ip is left untouched otherwise
+    std::string routeIp;
+    if (0 == connect(soc, (struct sockaddr *)&remote, sizeof(remote)) &&
+      0 == getsockname(soc, (struct sockaddr *)&local, &localLength)) {
+      routeIp = inet_ntoa(local.sin_addr);
+    }
+    closesocket(soc);
+    if (adapters.find(routeIp) != adapters.end()) {
+      ip = routeIp;
+      TRC_LEAVE("default route: " << PAR(ip));
+      return true;
+    }
+  }
+
+  bool retval = probe && probeMyAddress(ip);
+  TRC_LEAVE(PAR(retval) << PAR(ip));
+  return retval;
+}
+
+bool UdpChannel::probeMyAddress(std::string& ip)
+{
+  TRC_ENTER("");
 
   const int ATTEMPTS_CNT = 3;
   int attempts;
@@ -192,20 +1209,13 @@ void UdpChannel::getMyAddress()
   msgTrm[2] = (unsigned char)((secret >> 8) & 0xFF);
   msgTrm[3] = (unsigned char)(secret & 0xFF);
 
-  sockaddr_in iqrfUdpMyself;
-  socklen_t iqrfUdpMyselfLength = sizeof(iqrfUdpMyself);
-  socklen_t iqrfUdpListenerLength = sizeof(m_iqrfUdpListener);
+  socklen_t iqrfUdpListenerLength = sizeof(sockaddr_in);
 
-  memset(&iqrfUdpMyself, 0, sizeof(iqrfUdpMyself));
-  iqrfUdpMyself.sin_family = AF_INET;
-  iqrfUdpMyself.sin_port = htons(m_localPort);
-  iqrfUdpMyself.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-
-  // Local server, packets are received from any IP
+  // Local server, any free port as localPort may be already bound by the channel
   sockaddr_in iqrfUdpListener;
   memset(&iqrfUdpListener, 0, sizeof(iqrfUdpListener));
   iqrfUdpListener.sin_family = AF_INET;
-  iqrfUdpListener.sin_port = htons(m_localPort);
+  iqrfUdpListener.sin_port = 0;
   iqrfUdpListener.sin_addr.s_addr = htonl(INADDR_ANY);
 
   SOCKET soc;
@@ -220,19 +1230,40 @@ void UdpChannel::getMyAddress()
     THROW_EX(UdpChannelException, "setsockopt failed: " << GetLastError());
   }
 
+  // filtered broadcast must not block forever
+#ifndef WIN
+  struct timeval timeout;
+  timeout.tv_sec = (long)(m_discoveryTimeout.count() / 1000);
+  timeout.tv_usec = (long)(m_discoveryTimeout.count() % 1000) * 1000;
+#else
+  DWORD timeout = (DWORD)m_discoveryTimeout.count();
+#endif
+  if (0 != setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)))
+  {
+    closesocket(soc);
+    THROW_EX(UdpChannelException, "setsockopt failed: " << GetLastError());
+  }
+
   if (SOCKET_ERROR == bind(soc, (struct sockaddr *)&iqrfUdpListener, sizeof(iqrfUdpListener)))
   {
     closesocket(soc);
     THROW_EX(UdpChannelException, "bind failed: " << GetLastError());
   }
 
+  sockaddr_in iqrfUdpMyself;
+  socklen_t iqrfUdpMyselfLength = sizeof(iqrfUdpMyself);
+  getsockname(soc, (struct sockaddr *)&iqrfUdpMyself, &iqrfUdpMyselfLength);
+  iqrfUdpMyself.sin_family = AF_INET;
+  iqrfUdpMyself.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
   for (attempts = ATTEMPTS_CNT; attempts > 0; attempts--) {
     int recn = -1;
 
     TRC_DBG("Send to UDP to myself: " << PAR(attempts) << std::endl << FORM_HEX(msgTrm.data(), msgTrm.size()));
     int trmn = sendto(soc, (const char*)msgTrm.data(), msgTrm.size(), 0, (struct sockaddr *)&iqrfUdpMyself, sizeof(iqrfUdpMyself));
     if (trmn < 0) {
-      THROW_EX(UdpChannelException, "sendto failed: " << WSAGetLastError());
+      TRC_WAR("sendto failed: " << WSAGetLastError());
+      break;
     }
 
     unsigned char rx[16];
@@ -240,36 +1271,28 @@ void UdpChannel::getMyAddress()
 
     recn = recvfrom(soc, (char*)rx, 16, 0, (struct sockaddr *)&iqrfUdpListener, &iqrfUdpListenerLength);
     if (recn == SOCKET_ERROR) {
-      THROW_EX(UdpChannelException, "recvfrom failed: " << WSAGetLastError());
+      TRC_WAR("recvfrom failed: " << WSAGetLastError());
+      continue;
     }
 
     if (recn > 0) {
       TRC_DBG("Received from UDP: " << std::endl << FORM_HEX(rx, recn));
       std::basic_string<unsigned char> msgRec(rx, recn);
       if (msgTrm == msgRec) {
-        m_myIpAdress = inet_ntoa(iqrfUdpListener.sin_addr);    // my address is address of the last received packet
+        ip = inet_ntoa(iqrfUdpListener.sin_addr);    // my address is address of the last received packet
         break;
       }
     }
   }
 
-  if (attempts <= 0) {
-    THROW_EX(UdpChannelException, "Failed listen myself - cannot specify my IP address.");
-  }
-
-  getMyMacAddress(soc);
-  auto found = m_adapters.find(m_myIpAdress);
-  if (found != m_adapters.end()) {
-    m_myMacAdress = found->second.mMac;
-  }
-
   shutdown(soc, SHUT_RD);
   closesocket(soc);
 
-  TRC_LEAVE("");
+  TRC_LEAVE(PAR(attempts));
+  return attempts > 0;
 }
 
-void UdpChannel::getMyMacAddress(SOCKET soc)
+void UdpChannel::getMyAdapters(std::map<std::string, MyAdapter>& adapters)
 {
   TRC_ENTER("");
 #ifdef WIN
@@ -295,7 +1318,9 @@ void UdpChannel::getMyMacAddress(SOCKET soc)
 
       std::string mac(mac_addr);
       std::string ip(pAdapterInfo->IpAddressList.IpAddress.String);
-      m_adapters.insert(std::make_pair(ip, MyAdapter(ip, mac)));
+      if (ip != "0.0.0.0") {
+        adapters.insert(std::make_pair(ip, MyAdapter(ip, mac)));
+      }
 
       pAdapterInfo = pAdapterInfo->Next;
     } while (pAdapterInfo);
@@ -304,40 +1329,395 @@ void UdpChannel::getMyMacAddress(SOCKET soc)
   delete[] AdapterInfo;
 
 #else
-  struct if_nameindex *if_nidxs, *intf;
-  struct ifreq ifr;
-  if_nidxs = if_nameindex();
+  // IPv4 and link layer addresses of all interfaces in one shot
+  struct ifaddrs *ifaddr, *ifa;
+  if (getifaddrs(&ifaddr) != 0) {
+    TRC_WAR("getifaddrs failed: " << GetLastError());
+    TRC_LEAVE("");
+    return;
+  }
+
+  std::map<std::string, std::string> macs;
   char mac_addr[32];
+  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr != NULL && ifa->ifa_addr->sa_family == AF_PACKET) {
+      struct sockaddr_ll *ll = (struct sockaddr_ll *)ifa->ifa_addr;
+      unsigned char *mac = ll->sll_addr;
+      sprintf(mac_addr, "%02X-%02X-%02X-%02X-%02X-%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+      macs[ifa->ifa_name] = mac_addr;
+    }
+  }
 
-  if (if_nidxs != NULL) {
-    for (intf = if_nidxs; intf->if_index != 0 || intf->if_name != NULL; intf++) {
-      //printf("%s\t", intf->if_name);
+  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+      continue;
+    if ((ifa->ifa_flags & IFF_LOOPBACK) || !(ifa->ifa_flags & IFF_UP))
+      continue;
+
+    std::string ip(inet_ntoa(((struct sockaddr_in *)ifa->ifa_addr)->sin_addr));
+    std::string macStr("00-00-00-00-00-00");
+    auto found = macs.find(ifa->ifa_name);
+    if (found != macs.end()) {
+      macStr = found->second;
+    }
+    adapters.insert(std::make_pair(ip, MyAdapter(ip, macStr)));
+  }
+  freeifaddrs(ifaddr);
 
-      // Type of address to retrieve - IPv4 IP address
-      ifr.ifr_addr.sa_family = AF_INET;
-      // Copy the interface name in the ifreq structure
-      strncpy(ifr.ifr_name, intf->if_name, IFNAMSIZ - 1);
+#endif
+  TRC_LEAVE(NAME_PAR(adapters, adapters.size()));
+}
 
-      // Get MAC address
-      ioctl(soc, SIOCGIFHWADDR, &ifr);
-      unsigned char *mac = (unsigned char *)ifr.ifr_hwaddr.sa_data;
-      sprintf(mac_addr, "%02X-%02X-%02X-%02X-%02X-%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-      std::string macStr(mac_addr);
+std::string UdpChannel::getListeningIpAddress()
+{
+  std::lock_guard<std::mutex> lck(m_addressMtx);
+  return m_myIpAdress;
+}
 
-      // Get IPv4 address
-      ioctl(soc, SIOCGIFADDR, &ifr);
-      std::string ip(inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr));
+std::string UdpChannel::getListeningMacAddress()
+{
+  std::lock_guard<std::mutex> lck(m_addressMtx);
+  return m_myMacAdress;
+}
 
-      m_adapters.insert(std::make_pair(ip, MyAdapter(ip, macStr)));
+void UdpChannel::registerAddressChangeHandler(AddressChangeFunc addressChangeFunc)
+{
+  std::lock_guard<std::mutex> lck(m_addressMtx);
+  m_addressChangeFunc = addressChangeFunc;
+}
+
+void UdpChannel::unregisterAddressChangeHandler()
+{
+  std::lock_guard<std::mutex> lck(m_addressMtx);
+  m_addressChangeFunc = AddressChangeFunc();
+}
+
+#ifndef WIN
+void UdpChannel::openNetlink()
+{
+  m_netlinkSocket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (m_netlinkSocket == -1)
+    THROW_EX(UdpChannelException, "netlink socket failed: " << GetLastError());
+
+  sockaddr_nl local;
+  memset(&local, 0, sizeof(local));
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+
+  if (0 != bind(m_netlinkSocket, (struct sockaddr *)&local, sizeof(local)) || 0 != pipe(m_netlinkWakeFd)) {
+    close(m_netlinkSocket);
+    m_netlinkSocket = -1;
+    THROW_EX(UdpChannelException, "netlink bind failed: " << GetLastError());
+  }
+}
+
+void UdpChannel::watchNetlink()
+{
+  TRC_ENTER("thread starts");
 
+  // links first to know MACs and states, then addresses to catch changes missed since discovery
+  const int dumps[] = { RTM_GETLINK, RTM_GETADDR };
+  const unsigned dumpsCount = sizeof(dumps) / sizeof(dumps[0]);
+  unsigned dumpIdx = 0;
+  unsigned seq = 0;
+
+  std::vector<unsigned char> buf(16384);
+
+  while (true) {
+    // one dump at a time, the kernel refuses another one in progress by EBUSY
+    if (m_dumpSeq == 0 && dumpIdx == dumpsCount) {
+      if (m_redumpLinks)
+        dumpIdx = 0;
+      else if (m_redumpAddresses)
+        dumpIdx = 1;
+      m_redumpLinks = false;
+      m_redumpAddresses = false;
     }
+
+    if (m_dumpSeq == 0 && dumpIdx < dumpsCount) {
+      struct {
+        nlmsghdr nlh;
+        rtgenmsg gen;
+      } req;
+      memset(&req, 0, sizeof(req));
+      req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(rtgenmsg));
+      req.nlh.nlmsg_type = dumps[dumpIdx++];
+      req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+      req.nlh.nlmsg_seq = ++seq;
+      req.gen.rtgen_family = req.nlh.nlmsg_type == RTM_GETLINK ? AF_PACKET : AF_INET;
+      if (send(m_netlinkSocket, &req, req.nlh.nlmsg_len, 0) < 0) {
+        TRC_WAR("netlink dump request failed: " << GetLastError());
+      }
+      else {
+        m_dumpSeq = seq;
+        m_dumpType = req.nlh.nlmsg_type;
+        m_dumpedLinks.clear();
+        m_dumpedAddresses.clear();
+      }
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = m_netlinkSocket;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_netlinkWakeFd[0];
+    fds[1].events = POLLIN;
+
+    int res = poll(fds, 2, -1);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      TRC_WAR("poll failed: " << GetLastError());
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    int recn = recv(m_netlinkSocket, buf.data(), buf.size(), 0);
+    if (recn < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      if (errno == ENOBUFS) {
+        // events were lost, rebuild links and addresses by new dumps after the one in progress
+        TRC_WAR("netlink overrun");
+        m_redumpLinks = true;
+        continue;
+      }
+      TRC_WAR("netlink recv failed: " << GetLastError());
+      break;
+    }
+
+    processNetlink(buf.data(), recn);
   }
-  if_freenameindex(if_nidxs);
 
-#endif
-  TRC_LEAVE("");
+  TRC_LEAVE("thread stopped");
 }
 
+void UdpChannel::processNetlink(const unsigned char* buf, int len)
+{
+  for (const nlmsghdr* nlh = (const nlmsghdr*)buf; NLMSG_OK(nlh, (unsigned)len); nlh = NLMSG_NEXT(nlh, len)) {
+    // dump replies carry the request sequence number, events 0
+    bool dumped = m_dumpSeq != 0 && nlh->nlmsg_seq == m_dumpSeq;
+
+    switch (nlh->nlmsg_type) {
+
+    case NLMSG_DONE:
+      if (dumped)
+        finishDump(0);
+      break;
+
+    case NLMSG_ERROR:
+      if (dumped)
+        finishDump(((const nlmsgerr*)NLMSG_DATA(nlh))->error);
+      break;
+
+    case RTM_NEWLINK:
+    {
+      const ifinfomsg* ifi = (const ifinfomsg*)NLMSG_DATA(nlh);
+      if (dumped) {
+        m_dumpedLinks.insert(ifi->ifi_index);
+      }
+      if (ifi->ifi_flags & IFF_LOOPBACK) {
+        m_loopbackLinks.insert(ifi->ifi_index);
+      }
+      bool up = (ifi->ifi_flags & IFF_UP) != 0;
+      bool wasUp = m_upLinks.count(ifi->ifi_index) > 0;
+      if (up)
+        m_upLinks.insert(ifi->ifi_index);
+      else
+        m_upLinks.erase(ifi->ifi_index);
+      if (up != wasUp && !dumped) {
+        // addresses stay assigned to a link going down, so they are rebuilt by a dump
+        TRC_INF("Link state changed: " << NAME_PAR(ifindex, ifi->ifi_index) << PAR(up));
+        m_redumpAddresses = true;
+      }
+      int rtaLen = IFLA_PAYLOAD(nlh);
+      for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, rtaLen); rta = RTA_NEXT(rta, rtaLen)) {
+        if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) == 6) {
+          const unsigned char* mac = (const unsigned char*)RTA_DATA(rta);
+          char mac_addr[32];
+          sprintf(mac_addr, "%02X-%02X-%02X-%02X-%02X-%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+          m_linkMacs[ifi->ifi_index] = mac_addr;
+        }
+      }
+      break;
+    }
+
+    case RTM_DELLINK:
+    {
+      const ifinfomsg* ifi = (const ifinfomsg*)NLMSG_DATA(nlh);
+      m_linkMacs.erase(ifi->ifi_index);
+      m_loopbackLinks.erase(ifi->ifi_index);
+      m_upLinks.erase(ifi->ifi_index);
+      break;
+    }
+
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+    {
+      const ifaddrmsg* ifa = (const ifaddrmsg*)NLMSG_DATA(nlh);
+      if (ifa->ifa_family != AF_INET || m_loopbackLinks.count(ifa->ifa_index) > 0)
+        break;
+
+      // IFA_LOCAL is the local address on point to point links, IFA_ADDRESS otherwise
+      in_addr addr;
+      bool found = false;
+      int rtaLen = IFA_PAYLOAD(nlh);
+      for (const rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, rtaLen); rta = RTA_NEXT(rta, rtaLen)) {
+        if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && !found)) {
+          memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+          found = true;
+        }
+      }
+
+      // addresses of interfaces down are skipped like by getifaddrs() discovery
+      if (found && (nlh->nlmsg_type == RTM_DELADDR || m_upLinks.count(ifa->ifa_index) > 0)) {
+        std::string ip(inet_ntoa(addr));
+        // events during the dump count too, the dump may have passed the address already
+        if (m_dumpSeq != 0 && m_dumpType == RTM_GETADDR) {
+          if (nlh->nlmsg_type == RTM_NEWADDR)
+            m_dumpedAddresses.insert(ip);
+          else
+            m_dumpedAddresses.erase(ip);
+        }
+        updateAdapter(ip, ifa->ifa_index, nlh->nlmsg_type == RTM_NEWADDR);
+      }
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+}
+
+void UdpChannel::finishDump(int error)
+{
+  int dumpType = m_dumpType;
+  m_dumpSeq = 0;
+  m_dumpType = 0;
+
+  if (error != 0) {
+    TRC_WAR("netlink dump failed: " << NAME_PAR(errno, -error));
+    if (error == -EBUSY) {
+      if (dumpType == RTM_GETLINK)
+        m_redumpLinks = true;
+      else
+        m_redumpAddresses = true;
+    }
+    return;
+  }
+
+  // the dump is complete, drop what it didn't report
+  if (dumpType == RTM_GETLINK) {
+    for (auto it = m_linkMacs.begin(); it != m_linkMacs.end();) {
+      if (m_dumpedLinks.count(it->first) == 0)
+        it = m_linkMacs.erase(it);
+      else
+        ++it;
+    }
+    for (auto it = m_loopbackLinks.begin(); it != m_loopbackLinks.end();) {
+      if (m_dumpedLinks.count(*it) == 0)
+        it = m_loopbackLinks.erase(it);
+      else
+        ++it;
+    }
+    for (auto it = m_upLinks.begin(); it != m_upLinks.end();) {
+      if (m_dumpedLinks.count(*it) == 0)
+        it = m_upLinks.erase(it);
+      else
+        ++it;
+    }
+  }
+  else {
+    std::vector<std::string> removed;
+    {
+      std::lock_guard<std::mutex> lck(m_addressMtx);
+      for (const auto& adapter : m_adapters) {
+        if (m_dumpedAddresses.count(adapter.first) == 0)
+          removed.push_back(adapter.first);
+      }
+    }
+    for (const auto& ip : removed) {
+      updateAdapter(ip, -1, false);
+    }
+  }
+}
+
+void UdpChannel::updateAdapter(const std::string& ip, int ifindex, bool added)
+{
+  std::string mac("00-00-00-00-00-00");
+  auto foundMac = m_linkMacs.find(ifindex);
+  if (foundMac != m_linkMacs.end()) {
+    mac = foundMac->second;
+  }
+
+  bool changed = false;
+  bool reselect = false;
+  std::map<std::string, MyAdapter> adapters;
+  AddressChangeFunc addressChangeFunc;
+  {
+    std::lock_guard<std::mutex> lck(m_addressMtx);
+    auto found = m_adapters.find(ip);
+    if (added) {
+      if (found == m_adapters.end()) {
+        m_adapters.insert(std::make_pair(ip, MyAdapter(ip, mac)));
+        changed = true;
+      }
+      else if (found->second.mMac != mac) {
+        found->second.mMac = mac;
+        changed = true;
+      }
+      reselect = changed && (m_myIpAdress == "0.0.0.0" || m_myIpAdress == ip);
+    }
+    else if (found != m_adapters.end()) {
+      mac = found->second.mMac;
+      m_adapters.erase(found);
+      changed = true;
+      reselect = m_myIpAdress == ip;
+    }
+    adapters = m_adapters;
+    addressChangeFunc = m_addressChangeFunc;
+  }
+
+  if (!changed)
+    return;
+
+  TRC_INF("Local address changed: " << PAR(ip) << PAR(mac) << PAR(added));
+
+  if (reselect) {
+    // no broadcast probe here, the listening socket serves the port already
+    std::string myIp;
+    std::string myMac("00-00-00-00-00-00");
+    auto found = adapters.end();
+    if (getMyAddress(adapters, myIp, false)) {
+      found = adapters.find(myIp);
+    }
+    if (found == adapters.end()) {
+      found = adapters.begin();
+    }
+    if (found != adapters.end()) {
+      myIp = found->first;
+      myMac = found->second.mMac;
+    }
+    else {
+      myIp = "0.0.0.0";
+    }
+
+    std::lock_guard<std::mutex> lck(m_addressMtx);
+    m_myIpAdress = myIp;
+    m_myMacAdress = myMac;
+    TRC_INF("UDP listening on: " <<
+      NAME_PAR(IP, myIp) << NAME_PAR(port, m_localPort) << NAME_PAR(MAC, myMac));
+  }
+
+  if (addressChangeFunc) {
+    addressChangeFunc(ip, mac, added);
+  }
+}
+#endif
+
 IChannel::State UdpChannel::getState()
 {
   //TODO
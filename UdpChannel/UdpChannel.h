@@ -48,27 +48,208 @@ typedef size_t clientlen_t;
 #endif
 
 #include "IChannel.h"
+#include "LatencyHistogram.h"
+#include "TaskQueue.h"
+#include "HandlerSlot.h"
 #include <stdint.h>
 #include <exception>
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 #include <map>
+#include <unordered_map>
+#include <set>
+
+class IoUring;
 
 class UdpChannel : public IChannel
 {
 public:
+  /// Channel parameters
+  struct Config
+  {
+    Config()
+      :recvBatchSize(1)
+      , receiveShards(1)
+      , pinShards(false)
+      , deferDiscovery(false)
+      , discoveryTimeout(200)
+      , trackAddressChanges(false)
+      , peerIdleTimeout(std::chrono::seconds(60))
+      , maxPeers(4096)
+      , rxTimestamps(false)
+      , rcvBufSize(0)
+      , sndBufSize(0)
+      , detectDrops(false)
+      , busyPoll(false)
+      , busyPollIdle(100)
+      , busyPollBudget(50)
+      , ioUring(false)
+      , ioUringEntries(256)
+      , ioUringSendQueueSize(4096)
+      , dispatchQueueSize(0)
+      , dispatchDropPolicy(QueueDropPolicy::DropOldest)
+    {}
+
+    /// max datagrams read by one receive call (recvmmsg), 1 reads datagrams one by one
+    unsigned recvBatchSize;
+    /// number of sockets bound to localPort with SO_REUSEPORT, each with its own listen thread
+    /// handlers are invoked concurrently from these threads if more than 1
+    unsigned receiveShards;
+    /// pin listen thread of shard N to CPU N, recommended with busyPoll
+    bool pinShards;
+    /// discover local IP and MAC in background, the constructor doesn't wait for it
+    bool deferDiscovery;
+    /// max wait for each broadcast to itself if the local IP is ambiguous
+    std::chrono::milliseconds discoveryTimeout;
+    /// follow IPv4 address changes reported by netlink (Linux only)
+    bool trackAddressChanges;
+    /// peers silent for longer time are removed from the peer table, 0 keeps them forever
+    std::chrono::milliseconds peerIdleTimeout;
+    /// max peers in the peer table, a new peer evicts the least recently heard one of its table part
+    /// 0 is unlimited
+    unsigned maxPeers;
+    /// read kernel receive timestamps (SO_TIMESTAMPNS) and measure socket queue delay and handler time
+    bool rxTimestamps;
+    /// SO_RCVBUF size in bytes (SO_RCVBUFFORCE if permitted), 0 keeps system default
+    int rcvBufSize;
+    /// SO_SNDBUF size in bytes (SO_SNDBUFFORCE if permitted), 0 keeps system default
+    int sndBufSize;
+    /// count datagrams dropped by kernel for full receive buffer (SO_RXQ_OVFL)
+    bool detectDrops;
+    /// spin on non-blocking receive instead of sleeping in the kernel (Linux only)
+    /// trades a busy CPU core for lower wake-up latency
+    bool busyPoll;
+    /// spinning falls back to blocking receive after this time without data
+    std::chrono::milliseconds busyPollIdle;
+    /// SO_BUSY_POLL time the kernel polls the device queue per receive call, 0 doesn't set it
+    std::chrono::microseconds busyPollBudget;
+    /// receive by multishot recvmsg and send in batches by io_uring (Linux 6.0+)
+    /// falls back to recvmmsg and sendto if the kernel or the build lacks support
+    /// sendTo() only queues the datagram then, send errors are counted in Stats::sendErrors
+    /// busyPoll doesn't apply
+    bool ioUring;
+    /// io_uring SQ size, number of receive buffers per shard and max send batch, power of 2
+    unsigned ioUringEntries;
+    /// max datagrams waiting for io_uring send, sendTo() throws if the queue is full
+    unsigned ioUringSendQueueSize;
+    /// max receive batches waiting for handlers in a dispatch thread, 0 invokes handlers from listen threads
+    /// reading then never waits for the handlers, all shards share one dispatch thread
+    unsigned dispatchQueueSize;
+    /// what is dropped if handlers don't keep up and the dispatch queue is full
+    QueueDropPolicy dispatchDropPolicy;
+  };
+
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t received;
+    uint64_t receiveCalls;
+    uint64_t sent;
+    uint64_t peers;
+    uint64_t peersExpired;
+    /// peers evicted for Config::maxPeers, plus datagrams of new peers not tracked for it
+    uint64_t peersEvicted;
+    /// datagrams dropped by kernel, Config::detectDrops only
+    uint64_t kernelDrops;
+    /// number of times busy polling fell back to blocking receive, Config::busyPoll only
+    uint64_t busyPollFallbacks;
+    /// datagrams failed to be sent by io_uring, Config::ioUring only
+    uint64_t sendErrors;
+    /// send submissions to io_uring, Config::ioUring only
+    uint64_t sendBatches;
+    /// datagrams refused for full io_uring send queue, Config::ioUring only
+    uint64_t sendQueueFull;
+    /// receive batches dropped for full dispatch queue, Config::dispatchQueueSize only
+    uint64_t dispatchDropped;
+    /// receive batches waiting in dispatch queue
+    uint64_t dispatchQueued;
+    /// time datagrams spent in socket buffer, Config::rxTimestamps only
+    LatencyHistogram::Snapshot queueDelay;
+    /// time spent in receive handlers per receive call, Config::rxTimestamps only
+    LatencyHistogram::Snapshot handlerTime;
+  };
+
+  /// Received datagram metadata
+  struct PacketInfo
+  {
+    /// source endpoint
+    sockaddr_in from;
+    /// kernel receive time since epoch (CLOCK_REALTIME), 0 if not available
+    std::chrono::nanoseconds kernelTime;
+    /// time spent in socket buffer, 0 if not available
+    std::chrono::nanoseconds queueDelay;
+  };
+
+  // receive batch handler, all datagrams read by one receive call
+  typedef std::function<int(const std::vector<std::basic_string<unsigned char>>&)> ReceiveBatchFunc;
+
+  // receive data handler with the source endpoint
+  typedef std::function<int(const std::basic_string<unsigned char>&, const sockaddr_in&)> ReceiveFromPeerFunc;
+
+  // receive data handler with the datagram metadata
+  typedef std::function<int(const std::basic_string<unsigned char>&, const PacketInfo&)> ReceivePacketFunc;
+
+  // local address change handler, added is false if the address was removed
+  typedef std::function<void(const std::string& ip, const std::string& mac, bool added)> AddressChangeFunc;
+
   UdpChannel(unsigned short remotePort, unsigned short localPort, unsigned bufsize);
+  UdpChannel(unsigned short remotePort, unsigned short localPort, unsigned bufsize, const Config& cfg);
   virtual ~UdpChannel();
   void sendTo(const std::basic_string<unsigned char>& message) override;
   void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) override;
   void unregisterReceiveFromHandler() override;
   State getState() override;
 
-  const std::string& getListeningIpAddress() { return m_myIpAdress; }
+  /// \brief Send to given peer
+  /// \details
+  /// The peer is typically the source endpoint passed to the handler registered by registerReceiveFromPeerHandler().
+  void sendTo(const sockaddr_in& peer, const std::basic_string<unsigned char>& message);
+
+  /// \brief Register handler getting the source endpoint of each datagram
+  /// \details
+  /// The handler takes precedence over the other receive handlers.
+  /// If it returns 0 the source becomes the destination of sendTo() without peer.
+  void registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc);
+  void unregisterReceiveFromPeerHandler();
+
+  /// \brief Register handler getting the metadata of each datagram
+  /// \details
+  /// The handler takes precedence over the other receive handlers.
+  /// If it returns 0 the source becomes the destination of sendTo() without peer.
+  void registerReceivePacketHandler(ReceivePacketFunc receivePacketFunc);
+  void unregisterReceivePacketHandler();
+
+  /// \brief Get peers heard within Config::peerIdleTimeout
+  std::vector<sockaddr_in> getPeers();
+
+  /// \brief Register handler of datagram batches
+  /// \details
+  /// The handler takes precedence over the handler registered by registerReceiveFromHandler().
+  /// If it returns 0 the source of the last datagram in the batch becomes the destination of sendTo().
+  void registerReceiveBatchHandler(ReceiveBatchFunc receiveBatchFunc);
+  void unregisterReceiveBatchHandler();
+
+  Stats getStats() const;
+
+  /// \brief Check if datagrams are sent by io_uring
+  bool isIoUringSend() const { return m_sendUringActive; }
+
+  /// \brief Register handler of local address changes
+  /// \details
+  /// Invoked from the netlink thread if Config::trackAddressChanges is set.
+  /// The listening IP and MAC are already updated when the handler is called.
+  void registerAddressChangeHandler(AddressChangeFunc addressChangeFunc);
+  void unregisterAddressChangeHandler();
+
+  std::string getListeningIpAddress();
   unsigned short getListeningIpPort() { return m_localPort; }
-  const std::string& getListeningMacAddress() { return m_myMacAdress; }
-  bool isListening() { return m_isListening; }
+  std::string getListeningMacAddress();
+  bool isListening() { return m_listeningShards > 0; }
 
 private:
   class MyAdapter {
@@ -82,29 +263,176 @@ private:
     std::string mMac;
   };
 
+  // remote endpoint in the peer table
+  class Peer {
+  public:
+    sockaddr_in mAddr;
+    std::chrono::steady_clock::time_point mLastSeen;
+    uint64_t mReceived;
+  };
+
+  // socket bound to localPort with its listen thread and receive buffers
+  class Shard {
+  public:
+    Shard()
+      :mSocket(-1)
+      , mRx(nullptr)
+      , mKernelDrops(0)
+    {}
+    SOCKET mSocket;
+    std::thread mListenThread;
+    unsigned char* mRx;
+#ifndef WIN
+    std::vector<mmsghdr> mMsgs;
+    std::vector<iovec> mIovs;
+    std::vector<sockaddr_in> mFroms;
+    std::vector<unsigned char> mControl;
+#endif
+    uint32_t mKernelDrops;
+  };
+
   UdpChannel();
-  ReceiveFromFunc m_receiveFromFunc;
+  HandlerSlot<ReceiveFromFunc> m_receiveFromFunc;
+  HandlerSlot<ReceiveBatchFunc> m_receiveBatchFunc;
+  HandlerSlot<ReceiveFromPeerFunc> m_receiveFromPeerFunc;
+  HandlerSlot<ReceivePacketFunc> m_receivePacketFunc;
 
-  std::atomic_bool m_isListening;
-  bool m_runListenThread;
-  std::thread m_listenThread;
-  void listen();
-  void getMyAddress();
-  void getMyMacAddress(SOCKET soc);
+  std::atomic<int> m_listeningShards;
+  std::atomic_bool m_runListenThread;
+  void listen(Shard* shard);
+  // batch and infos are moved to the dispatch queue if there is one
+  void deliver(std::vector<std::basic_string<unsigned char>>& batch, std::vector<PacketInfo>& infos);
+  void dispatchTimed(const std::vector<std::basic_string<unsigned char>>& batch, const std::vector<PacketInfo>& infos);
+  void dispatch(const std::vector<std::basic_string<unsigned char>>& batch, const std::vector<PacketInfo>& infos);
+  bool listenUring(Shard* shard);
+  void sendUring();
+  void updatePeers(const std::vector<PacketInfo>& infos);
+#ifndef WIN
+  void processControl(Shard* shard, const msghdr& hdr, const struct timespec& now, PacketInfo& info);
+#endif
+  SOCKET openSocket(bool reusePort);
+  void setBufSize(SOCKET soc, int option, int size);
+  void closeShards();
+  void discover();
+  bool getMyAddress(const std::map<std::string, MyAdapter>& adapters, std::string& ip, bool probe = true);
+  bool probeMyAddress(std::string& ip);
+  void getMyAdapters(std::map<std::string, MyAdapter>& adapters);
 
+  // the socket of the first shard used to send
   SOCKET m_iqrfUdpSocket;
-  sockaddr_in m_iqrfUdpListener;
-  sockaddr_in m_iqrfUdpTalker;
+  // destination of sendTo(), broadcast until the first packet is received
+  std::atomic<uint32_t> m_iqrfUdpTalkerAddr;
 
   unsigned short m_remotePort;
   unsigned short m_localPort;
 
-  unsigned char* m_rx;
   unsigned m_bufsize;
+  unsigned m_recvBatchSize;
+  std::vector<Shard> m_shards;
+  bool m_pinShards;
+  bool m_rxTimestamps;
+  bool m_detectDrops;
+  int m_rcvBufSize;
+  int m_sndBufSize;
+  bool m_busyPoll;
+  std::chrono::milliseconds m_busyPollIdle;
+  std::chrono::microseconds m_busyPollBudget;
+  bool m_ioUring;
+  unsigned m_ioUringEntries;
+
+  // datagram waiting for io_uring send
+  class SendItem {
+  public:
+    sockaddr_in mTo;
+    std::basic_string<unsigned char> mMsg;
+  };
+  IoUring* m_sendRing;
+  std::atomic_bool m_sendUringActive;
+  bool m_runSendThread;
+  std::thread m_sendThread;
+  // m_sendUringActive is cleared under it so nothing is queued after the queue is taken over
+  std::mutex m_sendMtx;
+  std::condition_variable m_sendCondition;
+  std::deque<SendItem> m_sendQueue;
+  unsigned m_sendQueueSize;
+  std::atomic<uint64_t> m_sendQueueFull;
+
+  // receive batch waiting for handlers
+  class DispatchItem {
+  public:
+    std::vector<std::basic_string<unsigned char>> mBatch;
+    std::vector<PacketInfo> mInfos;
+  };
+  TaskQueue<DispatchItem>* m_dispatchQueue;
+  // ancillary data space per datagram
+  size_t m_controlLen;
+
+  std::atomic<uint64_t> m_received;
+  std::atomic<uint64_t> m_receiveCalls;
+  std::atomic<uint64_t> m_sent;
+
+  // peers by address and port, split to parts with own locks so shards don't contend
+  static const unsigned PEER_TABLE_PARTS = 16;
+  class PeerTablePart {
+  public:
+    std::mutex mMtx;
+    std::unordered_map<uint64_t, Peer> mPeers;
+  };
+  PeerTablePart m_peerTable[PEER_TABLE_PARTS];
+  std::atomic<uint64_t> m_peersCount;
+  unsigned m_maxPeers;
+  std::chrono::milliseconds m_peerIdleTimeout;
+  std::atomic<uint64_t> m_peersExpired;
+  std::atomic<uint64_t> m_peersEvicted;
+  // removes idle peers periodically, Config::peerIdleTimeout only
+  void sweepPeers();
+  bool m_runSweepThread;
+  std::thread m_sweepThread;
+  std::mutex m_sweepMtx;
+  std::condition_variable m_sweepCondition;
+  std::atomic<uint64_t> m_kernelDrops;
+  std::atomic<uint64_t> m_busyPollFallbacks;
+  std::atomic<uint64_t> m_sendErrors;
+  std::atomic<uint64_t> m_sendBatches;
+
+  LatencyHistogram m_queueDelay;
+  LatencyHistogram m_handlerTime;
 
+  std::chrono::milliseconds m_discoveryTimeout;
+  std::thread m_discoveryThread;
+  std::mutex m_addressMtx;
   std::string m_myIpAdress;
   std::string m_myMacAdress;
   std::map<std::string, MyAdapter> m_adapters;
+  AddressChangeFunc m_addressChangeFunc;
+
+#ifndef WIN
+  void openNetlink();
+  void watchNetlink();
+  void processNetlink(const unsigned char* buf, int len);
+  void finishDump(int error);
+  void updateAdapter(const std::string& ip, int ifindex, bool added);
+  int m_netlinkSocket;
+  int m_netlinkWakeFd[2];
+  // eventfd polled by io_uring listen threads to stop
+  int m_uringWakeFd;
+  std::thread m_netlinkThread;
+  // following members are used by the netlink thread only
+  // link layer addresses by interface index
+  std::map<int, std::string> m_linkMacs;
+  std::set<int> m_loopbackLinks;
+  // interfaces with IFF_UP, addresses of other interfaces are ignored
+  std::set<int> m_upLinks;
+  // sequence number and type of the dump in progress, 0 if none
+  unsigned m_dumpSeq;
+  int m_dumpType;
+  // links and addresses reported by the dump in progress, the rest is dropped when it finishes
+  std::set<int> m_dumpedLinks;
+  std::set<std::string> m_dumpedAddresses;
+  // dumps to be requested when the dump in progress finishes
+  bool m_redumpLinks;
+  bool m_redumpAddresses;
+#endif
 };
 
 class UdpChannelException : public std::exception {
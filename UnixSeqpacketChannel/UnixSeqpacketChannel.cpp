@@ -0,0 +1,297 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UnixSeqpacketChannel.h"
+#include "IqrfLogging.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+// max messages read from one peer per wake-up, the other peers wait meanwhile
+const unsigned READ_BATCH = 16;
+
+inline sockaddr_un makeAddress(const std::string& path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    THROW_EX(UnixSeqpacketChannelException, "invalid socket path: " << PAR(path));
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  return addr;
+}
+
+// peer in traces
+inline std::ostream& operator << (std::ostream& os, const UnixSeqpacketChannel::PeerInfo& info)
+{
+  return os << info.id << " pid " << info.pid;
+}
+
+UnixSeqpacketChannel::Peer::~Peer()
+{
+  close(mFd);
+}
+
+UnixSeqpacketChannel::UnixSeqpacketChannel(const std::string& path, unsigned bufsize, bool server)
+  :UnixSeqpacketChannel(path, bufsize, server, Config())
+{
+}
+
+UnixSeqpacketChannel::UnixSeqpacketChannel(const std::string& path, unsigned bufsize, bool server, const Config& cfg)
+  :m_path(path)
+  , m_server(server)
+  , m_sendTimeout(cfg.sendTimeout)
+  , m_rx(bufsize)
+  , m_bufsize(bufsize)
+  , m_peers(server, cfg.maxPeers, cfg.reconnectPeriod, {
+      [this](int fd, const sockaddr_storage&, uint32_t id) { return makePeer(fd, id); },
+      [this](Peer& peer, uint32_t events) { readPeer(peer, events); },
+      [this]() { connectServer(); },
+      nullptr })
+{
+  TRC_ENTER(PAR(path) << PAR(bufsize) << PAR(server));
+
+  m_received = 0;
+  m_sent = 0;
+  m_truncated = 0;
+
+  if (m_server) {
+    createServer();
+  }
+  else if (!connectServer()) {
+    TRC_WAR("server not available, connecting in background: " << PAR(m_path));
+  }
+
+  m_peers.start();
+  TRC_LEAVE("");
+}
+
+UnixSeqpacketChannel::~UnixSeqpacketChannel()
+{
+  // the thread uses the channel
+  m_peers.stop();
+  if (m_server)
+    unlink(m_path.c_str());
+}
+
+void UnixSeqpacketChannel::createServer()
+{
+  sockaddr_un addr = makeAddress(m_path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    THROW_EX(UnixSeqpacketChannelException, "socket() failed: " << NAME_PAR(GetLastError, GetLastError()));
+  }
+  // closed by m_peers from now on
+  m_peers.setListenSocket(fd);
+
+  // socket file of a previous run
+  unlink(m_path.c_str());
+  if (0 != bind(fd, (sockaddr*)&addr, sizeof(addr))) {
+    THROW_EX(UnixSeqpacketChannelException, "bind() failed: " << PAR(m_path) << NAME_PAR(GetLastError, GetLastError()));
+  }
+  if (0 != ::listen(fd, SOMAXCONN)) {
+    THROW_EX(UnixSeqpacketChannelException, "listen() failed: " << PAR(m_path) << NAME_PAR(GetLastError, GetLastError()));
+  }
+  TRC_INF("listening: " << PAR(m_path));
+}
+
+bool UnixSeqpacketChannel::connectServer()
+{
+  sockaddr_un addr = makeAddress(m_path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    TRC_WAR("socket() failed: " << NAME_PAR(GetLastError, GetLastError()));
+    return false;
+  }
+  if (0 != connect(fd, (sockaddr*)&addr, sizeof(addr))) {
+    TRC_DBG("connect() failed: " << PAR(m_path) << NAME_PAR(GetLastError, GetLastError()));
+    close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  // the server credentials are taken from the socket
+  sockaddr_storage peerAddr;
+  memset(&peerAddr, 0, sizeof(peerAddr));
+  return m_peers.addPeer(fd, peerAddr) != nullptr;
+}
+
+std::shared_ptr<UnixSeqpacketChannel::Peer> UnixSeqpacketChannel::makePeer(int fd, uint32_t id)
+{
+  PeerInfo info;
+  memset(&info, 0, sizeof(info));
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (0 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+    info.pid = cred.pid;
+    info.uid = cred.uid;
+    info.gid = cred.gid;
+  }
+  info.id = id;
+
+  return std::shared_ptr<Peer>(ant_new Peer(fd, info));
+}
+
+void UnixSeqpacketChannel::readPeer(Peer& peer, uint32_t events)
+{
+  uint32_t id = peer.mInfo.id;
+  // messages sent before hang-up are all read, then recv() returns 0
+  bool hangup = (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+  for (unsigned i = 0; hangup || i < READ_BATCH; i++) {
+    // MSG_TRUNC returns the real length of longer message
+    ssize_t len = recv(peer.mFd, m_rx.data(), m_bufsize, MSG_DONTWAIT | MSG_TRUNC);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (hangup)
+          m_peers.removePeer(id);
+        return;
+      }
+      TRC_WAR("recv() failed: " << PAR(id) << NAME_PAR(GetLastError, GetLastError()));
+      m_peers.removePeer(id);
+      return;
+    }
+    if (len == 0) {
+      m_peers.removePeer(id);
+      return;
+    }
+
+    m_received++;
+    if ((size_t)len > m_bufsize) {
+      TRC_WAR("message longer than buffer, dropped: " << PAR(id) << PAR(len) << PAR(m_bufsize));
+      m_truncated++;
+      continue;
+    }
+    m_peers.dispatch(std::basic_string<unsigned char>(m_rx.data(), len), peer.mInfo);
+  }
+}
+
+void UnixSeqpacketChannel::sendTo(const std::basic_string<unsigned char>& message)
+{
+  uint32_t id = m_peers.getLastPeerId();
+  if (id == 0) {
+    THROW_EX(UnixSeqpacketChannelException, "no peer to send to: " << PAR(m_path));
+  }
+  sendTo(id, message);
+}
+
+void UnixSeqpacketChannel::sendTo(uint32_t peerId, const std::basic_string<unsigned char>& message)
+{
+  TRC_DBG("Send to seqpacket: " << PAR(peerId) << std::endl << FORM_HEX(message.data(), message.size()));
+
+  std::shared_ptr<Peer> peer = m_peers.findPeer(peerId);
+  if (!peer) {
+    THROW_EX(UnixSeqpacketChannelException, "peer not connected: " << PAR(peerId));
+  }
+  sendToPeer(*peer, message);
+}
+
+void UnixSeqpacketChannel::sendToPeer(const Peer& peer, const std::basic_string<unsigned char>& message)
+{
+  // the receiver couldn't tell empty message from hang-up
+  if (message.empty()) {
+    THROW_EX(UnixSeqpacketChannelException, "empty message can't be sent");
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + m_sendTimeout;
+  while (true) {
+    ssize_t len = send(peer.mFd, message.data(), message.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (len >= 0) {
+      m_sent++;
+      return;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      THROW_EX(UnixSeqpacketChannelException, "send() failed: " << NAME_PAR(peer, peer.mInfo.id) << NAME_PAR(GetLastError, GetLastError()));
+    }
+
+    // a stuck peer can't block the sender for longer than sendTimeout
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) {
+      THROW_EX(UnixSeqpacketChannelException, "send() timed out: " << NAME_PAR(peer, peer.mInfo.id));
+    }
+    pollfd pfd;
+    pfd.fd = peer.mFd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, (int)left.count());
+  }
+}
+
+void UnixSeqpacketChannel::registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc)
+{
+  m_peers.registerReceiveFromHandler(receiveFromFunc);
+}
+
+void UnixSeqpacketChannel::unregisterReceiveFromHandler()
+{
+  m_peers.unregisterReceiveFromHandler();
+}
+
+void UnixSeqpacketChannel::registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc)
+{
+  m_peers.registerReceiveFromPeerHandler(receiveFromPeerFunc);
+}
+
+void UnixSeqpacketChannel::unregisterReceiveFromPeerHandler()
+{
+  m_peers.unregisterReceiveFromPeerHandler();
+}
+
+void UnixSeqpacketChannel::registerPeerEventHandler(PeerEventFunc peerEventFunc)
+{
+  m_peers.registerPeerEventHandler(peerEventFunc);
+}
+
+void UnixSeqpacketChannel::unregisterPeerEventHandler()
+{
+  m_peers.unregisterPeerEventHandler();
+}
+
+IChannel::State UnixSeqpacketChannel::getState()
+{
+  return m_peers.getState();
+}
+
+std::vector<UnixSeqpacketChannel::PeerInfo> UnixSeqpacketChannel::getPeers() const
+{
+  return m_peers.getPeers();
+}
+
+UnixSeqpacketChannel::Stats UnixSeqpacketChannel::getStats() const
+{
+  Stats stats;
+  stats.received = m_received;
+  stats.sent = m_sent;
+  stats.truncated = m_truncated;
+  EpollPeers<Peer, PeerInfo, UnixSeqpacketChannelException>::Stats peerStats = m_peers.getStats();
+  stats.connected = peerStats.connected;
+  stats.rejected = peerStats.rejected;
+  stats.disconnected = peerStats.disconnected;
+  stats.peers = peerStats.peers;
+  return stats;
+}
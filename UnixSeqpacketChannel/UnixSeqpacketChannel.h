@@ -0,0 +1,190 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "PlatformDep.h"
+
+#include "IChannel.h"
+#include "EpollPeers.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+/// \class UnixSeqpacketChannel
+/// \brief Local IPC channel over Unix domain SOCK_SEQPACKET socket (Linux only)
+/// \details
+/// Server accepts many peers on one socket path, client connects to the server and reconnects if it goes away.
+/// Message boundaries are kept by the socket. All sockets are served by one epoll thread which invokes
+/// the handlers, a disconnected peer is detected as soon as its socket is closed.
+class UnixSeqpacketChannelException;
+
+class UnixSeqpacketChannel : public IChannel
+{
+public:
+  /// Channel parameters
+  struct Config
+  {
+    Config()
+      :maxPeers(64)
+      , sendTimeout(1000)
+      , reconnectPeriod(1000)
+    {}
+
+    /// server rejects connections above this number of peers
+    unsigned maxPeers;
+    /// max wait for room in the peer socket buffer, sendTo() throws then
+    std::chrono::milliseconds sendTimeout;
+    /// client connection attempts period while the server isn't available
+    std::chrono::milliseconds reconnectPeriod;
+  };
+
+  /// Channel statistics
+  struct Stats
+  {
+    uint64_t received;
+    uint64_t sent;
+    /// messages longer than bufsize, dropped
+    uint64_t truncated;
+    /// peers connected to the server or reconnects of the client
+    uint64_t connected;
+    /// peers refused for Config::maxPeers
+    uint64_t rejected;
+    uint64_t disconnected;
+    /// currently connected peers
+    uint64_t peers;
+  };
+
+  /// Connected peer, credentials are taken from the socket (SO_PEERCRED)
+  struct PeerInfo
+  {
+    /// unique within the channel, the server is the peer of the client
+    uint32_t id;
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+  };
+
+  // receive data handler with the source peer
+  typedef std::function<int(const std::basic_string<unsigned char>&, const PeerInfo&)> ReceiveFromPeerFunc;
+
+  // peer connection handler, connected is false if the peer disconnected
+  typedef std::function<void(const PeerInfo&, bool connected)> PeerEventFunc;
+
+  /// \brief Create server or client
+  /// \param [in] path socket path, server removes stale socket file and creates a new one
+  /// \param [in] bufsize max received message size
+  /// \param [in] server accept peers if true, connect to the server otherwise
+  /// \throw UnixSeqpacketChannelException if the server socket can't be created
+  /// \details
+  /// Client doesn't fail if the server isn't available yet, it connects later in background.
+  UnixSeqpacketChannel(const std::string& path, unsigned bufsize, bool server = false);
+  UnixSeqpacketChannel(const std::string& path, unsigned bufsize, bool server, const Config& cfg);
+  virtual ~UnixSeqpacketChannel();
+
+  /// \brief Send to the server (client) or to the peer of the last message (server)
+  /// \throw UnixSeqpacketChannelException if there is no such peer, the peer disconnected or send timed out
+  void sendTo(const std::basic_string<unsigned char>& message) override;
+  void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) override;
+  void unregisterReceiveFromHandler() override;
+  State getState() override;
+
+  /// \brief Send to given peer
+  /// \throw UnixSeqpacketChannelException if the peer disconnected or send timed out
+  void sendTo(uint32_t peerId, const std::basic_string<unsigned char>& message);
+
+  /// \brief Register handler getting the source peer of each message
+  /// \details
+  /// The handler takes precedence over the handler registered by registerReceiveFromHandler().
+  /// If it returns 0 the peer becomes the destination of sendTo() without peer.
+  void registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc);
+  void unregisterReceiveFromPeerHandler();
+
+  /// \brief Register handler of peer connects and disconnects
+  /// \details
+  /// Invoked from the channel thread before the first message of the peer and after its last message.
+  void registerPeerEventHandler(PeerEventFunc peerEventFunc);
+  void unregisterPeerEventHandler();
+
+  /// \brief Get connected peers
+  std::vector<PeerInfo> getPeers() const;
+
+  Stats getStats() const;
+
+private:
+  // connected socket, closed when the last sender releases it
+  struct Peer
+  {
+    Peer(int fd, const PeerInfo& info)
+      :mFd(fd)
+      , mInfo(info)
+    {}
+    ~Peer();
+
+    int mFd;
+    PeerInfo mInfo;
+  };
+
+  UnixSeqpacketChannel();
+  UnixSeqpacketChannel(const UnixSeqpacketChannel&);
+  UnixSeqpacketChannel& operator = (const UnixSeqpacketChannel&);
+
+  void createServer();
+  bool connectServer();
+  std::shared_ptr<Peer> makePeer(int fd, uint32_t id);
+  void readPeer(Peer& peer, uint32_t events);
+  void sendToPeer(const Peer& peer, const std::basic_string<unsigned char>& message);
+
+  std::string m_path;
+  bool m_server;
+  std::chrono::milliseconds m_sendTimeout;
+
+  // receive buffer, used by the epoll thread only
+  std::vector<unsigned char> m_rx;
+  unsigned m_bufsize;
+
+  std::atomic<uint64_t> m_received;
+  std::atomic<uint64_t> m_sent;
+  std::atomic<uint64_t> m_truncated;
+
+  // destroyed first, its thread uses the members above
+  EpollPeers<Peer, PeerInfo, UnixSeqpacketChannelException> m_peers;
+};
+
+class UnixSeqpacketChannelException : public std::exception {
+public:
+  UnixSeqpacketChannelException(const std::string& cause)
+    :m_cause(cause)
+  {}
+
+  virtual const char* what() const noexcept(true)
+  {
+    return m_cause.c_str();
+  }
+
+  virtual ~UnixSeqpacketChannelException()
+  {}
+
+protected:
+  std::string m_cause;
+};
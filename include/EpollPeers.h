@@ -0,0 +1,452 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "IChannel.h"
+#include "HandlerSlot.h"
+#include "IqrfLogging.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+
+/// \class EpollPeers
+/// \brief Connected peers of a socket channel served by one epoll thread (Linux only)
+/// \details
+/// Common part of the channels with many peers on one socket type. Owns the epoll and wake-up descriptors,
+/// the listening socket of the server, the table of connected peers and the thread which waits for events.
+/// The thread accepts peers, reconnects the client and passes events of peer sockets to the channel
+/// which reads and writes them. Received messages are passed to the handlers by dispatch().
+/// Peer has members int mFd and PeerInfo mInfo, PeerInfo has member uint32_t id and operator << for traces.
+/// Peer closes mFd in its destructor, a sender still holding the peer keeps the descriptor valid.
+template <class Peer, class PeerInfo, class Exception>
+class EpollPeers
+{
+public:
+  // receive data handler with the source peer
+  typedef std::function<int(const std::basic_string<unsigned char>&, const PeerInfo&)> ReceiveFromPeerFunc;
+
+  // peer connection handler, connected is false if the peer disconnected
+  typedef std::function<void(const PeerInfo&, bool connected)> PeerEventFunc;
+
+  /// Channel callbacks, invoked from the epoll thread unless stated otherwise
+  struct Callbacks
+  {
+    /// create peer of connected socket, nullptr closes it, invoked by addPeer()
+    std::function<std::shared_ptr<Peer>(int fd, const sockaddr_storage& addr, uint32_t id)> makePeer;
+    /// events of the peer socket
+    std::function<void(Peer& peer, uint32_t events)> peerEvents;
+    /// client isn't connected, invoked every reconnect period
+    std::function<void()> reconnect;
+    /// peer removed or the channel stopped, sends waiting for the peer are to fail, optional
+    std::function<void(Peer& peer)> closed;
+  };
+
+  struct Stats
+  {
+    /// peers connected to the server or connects of the client
+    uint64_t connected;
+    /// peers refused for max peers
+    uint64_t rejected;
+    uint64_t disconnected;
+    /// currently connected peers
+    uint64_t peers;
+  };
+
+  /// \brief Create epoll and wake-up descriptors, the thread is started by start()
+  /// \param [in] server accept peers if true, reconnect otherwise
+  /// \param [in] maxPeers server rejects connections above this number of peers
+  /// \param [in] reconnectPeriod client connection attempts period
+  /// \throw Exception if the descriptors can't be created
+  EpollPeers(bool server, unsigned maxPeers, std::chrono::milliseconds reconnectPeriod, const Callbacks& callbacks)
+    :m_callbacks(callbacks)
+    , m_server(server)
+    , m_maxPeers(maxPeers)
+    , m_reconnectPeriod(reconnectPeriod)
+    , m_epollFd(-1)
+    , m_listenFd(-1)
+    , m_wakeFd(-1)
+    , m_nextPeerId(FIRST_PEER_ID)
+  {
+    m_lastPeerId = 0;
+    m_runThread = true;
+    m_state = IChannel::State::NotReady;
+    m_connected = 0;
+    m_rejected = 0;
+    m_disconnected = 0;
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd < 0) {
+      THROW_EX(Exception, "epoll_create1() failed: " << NAME_PAR(GetLastError, GetLastError()));
+    }
+
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wakeFd < 0) {
+      int err = GetLastError();
+      close(m_epollFd);
+      THROW_EX(Exception, "eventfd() failed: " << NAME_PAR(GetLastError, err));
+    }
+    if (!watch(m_wakeFd, EPOLL_CTL_ADD, EPOLLIN, WAKE_KEY)) {
+      int err = GetLastError();
+      close(m_wakeFd);
+      close(m_epollFd);
+      THROW_EX(Exception, "epoll_ctl() failed: " << NAME_PAR(GetLastError, err));
+    }
+  }
+
+  /// \brief Stop the thread and close all descriptors
+  ~EpollPeers()
+  {
+    stop();
+    if (m_listenFd >= 0)
+      close(m_listenFd);
+    close(m_wakeFd);
+    close(m_epollFd);
+  }
+
+  /// \brief Serve the server socket, called before start()
+  /// \details
+  /// The socket is owned from now on, it is closed by the destructor even if this throws.
+  /// \throw Exception if the socket can't be watched
+  void setListenSocket(int fd)
+  {
+    m_listenFd = fd;
+    if (!watch(m_listenFd, EPOLL_CTL_ADD, EPOLLIN, LISTEN_KEY)) {
+      THROW_EX(Exception, "epoll_ctl() failed: " << NAME_PAR(GetLastError, GetLastError()));
+    }
+    m_state = IChannel::State::Ready;
+  }
+
+  void start()
+  {
+    m_thread = std::thread(&EpollPeers::run, this);
+  }
+
+  /// \brief Stop the thread and disconnect all peers without notifying the handlers
+  /// \details
+  /// Called first by the channel destructor, the callbacks may use the channel until then.
+  void stop()
+  {
+    m_runThread = false;
+    if (m_thread.joinable()) {
+      TRC_DBG("joining epoll thread");
+      uint64_t wake = 1;
+      if (write(m_wakeFd, &wake, sizeof(wake)) < 0) {
+        TRC_WAR("eventfd write failed: " << NAME_PAR(GetLastError, GetLastError()));
+      }
+      m_thread.join();
+      TRC_DBG("epoll thread joined");
+    }
+
+    std::lock_guard<std::mutex> lck(m_peersMtx);
+    for (auto& peer : m_peers) {
+      if (m_callbacks.closed)
+        m_callbacks.closed(*peer.second);
+      // pending sendTo() fails, the descriptor is closed by the last owner
+      shutdown(peer.second->mFd, SHUT_RDWR);
+    }
+    m_peers.clear();
+  }
+
+  /// \brief Check the caller is the epoll thread, e.g. a handler
+  bool isEpollThread() const
+  {
+    return std::this_thread::get_id() == m_thread.get_id();
+  }
+
+  /// \brief Add connected socket, accepted by the server or connected by the client
+  /// \details
+  /// The peer is created by Callbacks::makePeer, the peer event handler is notified.
+  /// \return nullptr if the peer can't be added, the socket is closed then
+  std::shared_ptr<Peer> addPeer(int fd, const sockaddr_storage& addr)
+  {
+    std::shared_ptr<Peer> peer = m_callbacks.makePeer(fd, addr, m_nextPeerId++);
+    if (!peer) {
+      close(fd);
+      return nullptr;
+    }
+
+    if (!watch(fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP, peer->mInfo.id)) {
+      TRC_WAR("epoll_ctl() failed: " << NAME_PAR(GetLastError, GetLastError()));
+      return nullptr;
+    }
+    {
+      std::lock_guard<std::mutex> lck(m_peersMtx);
+      m_peers[peer->mInfo.id] = peer;
+    }
+
+    if (!m_server) {
+      m_lastPeerId = peer->mInfo.id;
+      m_state = IChannel::State::Ready;
+    }
+    m_connected++;
+    TRC_INF("peer connected: " << NAME_PAR(peer, peer->mInfo));
+    notifyPeerEvent(peer->mInfo, true);
+    return peer;
+  }
+
+  /// \brief Remove the peer and notify the peer event handler, nothing is done if it is already removed
+  void removePeer(uint32_t id)
+  {
+    std::shared_ptr<Peer> peer;
+    {
+      std::lock_guard<std::mutex> lck(m_peersMtx);
+      auto found = m_peers.find(id);
+      if (found == m_peers.end())
+        return;
+      peer = found->second;
+      m_peers.erase(found);
+    }
+
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, peer->mFd, NULL);
+    if (m_callbacks.closed)
+      m_callbacks.closed(*peer);
+    // pending sendTo() fails, the descriptor is closed by the last owner
+    shutdown(peer->mFd, SHUT_RDWR);
+
+    uint32_t lastPeerId = id;
+    m_lastPeerId.compare_exchange_strong(lastPeerId, 0);
+    if (!m_server)
+      m_state = IChannel::State::NotReady;
+    m_disconnected++;
+    TRC_INF("peer disconnected: " << NAME_PAR(peer, peer->mInfo));
+    notifyPeerEvent(peer->mInfo, false);
+  }
+
+  std::shared_ptr<Peer> findPeer(uint32_t id) const
+  {
+    std::lock_guard<std::mutex> lck(m_peersMtx);
+    auto found = m_peers.find(id);
+    return found != m_peers.end() ? found->second : nullptr;
+  }
+
+  /// \brief Change watched events of the peer socket
+  /// \return false if epoll_ctl() failed
+  bool watchPeer(const Peer& peer, uint32_t events)
+  {
+    return watch(peer.mFd, EPOLL_CTL_MOD, events, peer.mInfo.id);
+  }
+
+  /// \brief Pass received message to the handlers
+  /// \details
+  /// If the handler returns 0 the server sends to the peer by sendTo() without peer.
+  void dispatch(const std::basic_string<unsigned char>& message, const PeerInfo& info)
+  {
+    typename HandlerSlot<ReceiveFromPeerFunc>::Reader receiveFromPeerFunc(m_receiveFromPeerFunc);
+    if (receiveFromPeerFunc) {
+      if (0 == (*receiveFromPeerFunc)(message, info) && m_server) {
+        m_lastPeerId = info.id;    // Change the destination to the peer of the last received message
+      }
+      return;
+    }
+
+    HandlerSlot<IChannel::ReceiveFromFunc>::Reader receiveFromFunc(m_receiveFromFunc);
+    if (receiveFromFunc) {
+      if (0 == (*receiveFromFunc)(message) && m_server) {
+        m_lastPeerId = info.id;    // Change the destination to the peer of the last received message
+      }
+      return;
+    }
+
+    TRC_WAR("Unregistered receiveFrom() handler");
+  }
+
+  /// \brief Get destination of sendTo() without peer, 0 if none
+  uint32_t getLastPeerId() const { return m_lastPeerId; }
+
+  IChannel::State getState() const { return m_state; }
+
+  std::vector<PeerInfo> getPeers() const
+  {
+    std::vector<PeerInfo> peers;
+    std::lock_guard<std::mutex> lck(m_peersMtx);
+    for (auto& peer : m_peers)
+      peers.push_back(peer.second->mInfo);
+    return peers;
+  }
+
+  /// \brief Invoke func for each peer with the peer table locked
+  void forEachPeer(std::function<void(Peer& peer)> func) const
+  {
+    std::lock_guard<std::mutex> lck(m_peersMtx);
+    for (auto& peer : m_peers)
+      func(*peer.second);
+  }
+
+  Stats getStats() const
+  {
+    Stats stats;
+    stats.connected = m_connected;
+    stats.rejected = m_rejected;
+    stats.disconnected = m_disconnected;
+    {
+      std::lock_guard<std::mutex> lck(m_peersMtx);
+      stats.peers = m_peers.size();
+    }
+    return stats;
+  }
+
+  void registerReceiveFromHandler(IChannel::ReceiveFromFunc receiveFromFunc) { m_receiveFromFunc.set(receiveFromFunc); }
+  void unregisterReceiveFromHandler() { m_receiveFromFunc.reset(); }
+  void registerReceiveFromPeerHandler(ReceiveFromPeerFunc receiveFromPeerFunc) { m_receiveFromPeerFunc.set(receiveFromPeerFunc); }
+  void unregisterReceiveFromPeerHandler() { m_receiveFromPeerFunc.reset(); }
+  void registerPeerEventHandler(PeerEventFunc peerEventFunc) { m_peerEventFunc.set(peerEventFunc); }
+  void unregisterPeerEventHandler() { m_peerEventFunc.reset(); }
+
+private:
+  // epoll keys, peers are numbered from FIRST_PEER_ID
+  static const uint64_t WAKE_KEY = 0;
+  static const uint64_t LISTEN_KEY = 1;
+  static const uint32_t FIRST_PEER_ID = 2;
+  static const int MAX_EVENTS = 64;
+
+  EpollPeers(const EpollPeers&);
+  EpollPeers& operator = (const EpollPeers&);
+
+  bool watch(int fd, int op, uint32_t events, uint64_t key)
+  {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = key;
+    return 0 == epoll_ctl(m_epollFd, op, fd, &ev);
+  }
+
+  void run()
+  {
+    TRC_ENTER("thread starts");
+
+    epoll_event events[MAX_EVENTS];
+    while (m_runThread) {
+      // disconnected client wakes up periodically to connect again
+      int timeout = -1;
+      if (!m_server && m_state != IChannel::State::Ready)
+        timeout = (int)m_reconnectPeriod.count();
+
+      int num = epoll_wait(m_epollFd, events, MAX_EVENTS, timeout);
+      if (num < 0) {
+        if (errno == EINTR)
+          continue;
+        TRC_ERR("epoll_wait() failed: " << NAME_PAR(GetLastError, GetLastError()));
+        break;
+      }
+      if (num == 0 && m_runThread) {
+        m_callbacks.reconnect();
+        continue;
+      }
+
+      for (int i = 0; i < num && m_runThread; i++) {
+        uint64_t key = events[i].data.u64;
+        if (key == WAKE_KEY)
+          break;
+        else if (key == LISTEN_KEY)
+          acceptPeers();
+        else {
+          // peer removed by an earlier event of the same batch
+          std::shared_ptr<Peer> peer = findPeer((uint32_t)key);
+          if (peer)
+            m_callbacks.peerEvents(*peer, events[i].events);
+        }
+      }
+    }
+
+    m_state = IChannel::State::NotReady;
+    TRC_LEAVE("thread stopped");
+  }
+
+  void acceptPeers()
+  {
+    while (true) {
+      sockaddr_storage addr;
+      socklen_t len = sizeof(addr);
+      memset(&addr, 0, sizeof(addr));
+      int fd = accept4(m_listenFd, (sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          TRC_WAR("accept4() failed: " << NAME_PAR(GetLastError, GetLastError()));
+        }
+        return;
+      }
+
+      size_t peers;
+      {
+        std::lock_guard<std::mutex> lck(m_peersMtx);
+        peers = m_peers.size();
+      }
+      if (peers >= m_maxPeers) {
+        TRC_WAR("too many peers, connection refused: " << PAR(peers));
+        close(fd);
+        m_rejected++;
+        continue;
+      }
+
+      addPeer(fd, addr);
+    }
+  }
+
+  void notifyPeerEvent(const PeerInfo& info, bool connected)
+  {
+    typename HandlerSlot<PeerEventFunc>::Reader peerEventFunc(m_peerEventFunc);
+    if (peerEventFunc) {
+      (*peerEventFunc)(info, connected);
+    }
+  }
+
+  Callbacks m_callbacks;
+  HandlerSlot<IChannel::ReceiveFromFunc> m_receiveFromFunc;
+  HandlerSlot<ReceiveFromPeerFunc> m_receiveFromPeerFunc;
+  HandlerSlot<PeerEventFunc> m_peerEventFunc;
+
+  bool m_server;
+  unsigned m_maxPeers;
+  std::chrono::milliseconds m_reconnectPeriod;
+
+  int m_epollFd;
+  // server socket
+  int m_listenFd;
+  // signaled by stop()
+  int m_wakeFd;
+
+  mutable std::mutex m_peersMtx;
+  std::map<uint32_t, std::shared_ptr<Peer>> m_peers;
+  // used by the epoll thread only, and by the client before start()
+  uint32_t m_nextPeerId;
+  // destination of sendTo() without peer, 0 if none
+  std::atomic<uint32_t> m_lastPeerId;
+
+  std::atomic_bool m_runThread;
+  std::thread m_thread;
+  std::atomic<IChannel::State> m_state;
+
+  std::atomic<uint64_t> m_connected;
+  std::atomic<uint64_t> m_rejected;
+  std::atomic<uint64_t> m_disconnected;
+};
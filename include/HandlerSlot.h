@@ -0,0 +1,178 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "PlatformDep.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// \class HandlerSlot
+/// \brief Handler storage with lock-free reads and safe replacement
+/// \details
+/// Receive threads invoke the handler through Reader without taking a lock. Readers register
+/// in one of two epochs. set() publishes the new handler, switches readers to the other epoch
+/// and waits until the readers of the previous epoch leave. When set() returns the old handler
+/// isn't running in any thread and it is destroyed.
+/// A handler may replace or clear its own slot. Such set() doesn't wait as the caller itself
+/// is a reader, the old handler is destroyed by the next set() from outside or with the slot.
+template <class F>
+class HandlerSlot
+{
+private:
+  // active Readers of the thread, innermost first
+  struct ReaderState
+  {
+    const void* slot;
+    const ReaderState* outer;
+  };
+
+  static const ReaderState*& innermostReader()
+  {
+    static thread_local const ReaderState* state = nullptr;
+    return state;
+  }
+
+public:
+  /// \class Reader
+  /// \brief Access to the current handler for the life of the Reader
+  class Reader
+  {
+  public:
+    Reader(const HandlerSlot& slot)
+      :m_slot(slot)
+    {
+      // retry if set() switched the epoch in between, its wait could miss the reader otherwise
+      while (true) {
+        m_epoch = m_slot.m_epoch.load();
+        m_slot.m_readers[m_epoch].fetch_add(1);
+        if (m_slot.m_epoch.load() == m_epoch)
+          break;
+        m_slot.m_readers[m_epoch].fetch_sub(1);
+      }
+      m_func = m_slot.m_func.load();
+      m_state.slot = &m_slot;
+      m_state.outer = innermostReader();
+      innermostReader() = &m_state;
+    }
+
+    ~Reader()
+    {
+      innermostReader() = m_state.outer;
+      m_slot.m_readers[m_epoch].fetch_sub(1);
+    }
+
+    explicit operator bool() const { return m_func != nullptr; }
+    const F& operator*() const { return *m_func; }
+
+  private:
+    Reader(const Reader&);
+    Reader& operator = (const Reader&);
+
+    const HandlerSlot& m_slot;
+    ReaderState m_state;
+    unsigned m_epoch;
+    F* m_func;
+  };
+
+  HandlerSlot()
+  {
+    m_func = nullptr;
+    m_epoch = 0;
+    m_readers[0] = 0;
+    m_readers[1] = 0;
+  }
+
+  virtual ~HandlerSlot()
+  {
+    delete m_func.load();
+    for (auto func : m_retired)
+      delete func;
+  }
+
+  /// \brief Replace handler
+  /// \param [in] func new handler, empty function clears the slot
+  /// \details
+  /// Blocks until the replaced handler returns in all threads unless called from a handler of this slot.
+  void set(const F& func)
+  {
+    F* fresh = func ? ant_new F(func) : nullptr;
+
+    if (isReading()) {
+      // waiting here could deadlock with another set() waiting for this reader
+      std::lock_guard<std::mutex> lck(m_retiredMtx);
+      F* old = m_func.exchange(fresh);
+      if (old)
+        m_retired.push_back(old);
+      return;
+    }
+
+    std::lock_guard<std::mutex> lck(m_writeMtx);
+    std::vector<F*> retired;
+    F* old;
+    {
+      std::lock_guard<std::mutex> lck(m_retiredMtx);
+      old = m_func.exchange(fresh);
+      retired.swap(m_retired);
+    }
+
+    // only the current epoch has readers, the previous one was drained by the last set()
+    unsigned prev = m_epoch.load();
+    m_epoch.store(prev ^ 1);
+    while (m_readers[prev].load() > 0)
+      std::this_thread::yield();
+
+    delete old;
+    for (auto func : retired)
+      delete func;
+  }
+
+  /// \brief Clear handler
+  void reset()
+  {
+    set(F());
+  }
+
+  /// \brief Check if handler is set
+  bool empty() const
+  {
+    return m_func.load() == nullptr;
+  }
+
+private:
+  HandlerSlot(const HandlerSlot&);
+  HandlerSlot& operator = (const HandlerSlot&);
+
+  // check if called from a handler of this slot
+  bool isReading() const
+  {
+    for (const ReaderState* state = innermostReader(); state != nullptr; state = state->outer) {
+      if (state->slot == this)
+        return true;
+    }
+    return false;
+  }
+
+  std::atomic<F*> m_func;
+  mutable std::atomic<unsigned> m_epoch;
+  mutable std::atomic<unsigned> m_readers[2];
+  std::mutex m_writeMtx;
+  std::mutex m_retiredMtx;
+  // handlers replaced from a handler, possibly still running
+  std::vector<F*> m_retired;
+};
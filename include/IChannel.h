@@ -52,7 +52,8 @@ public:
   virtual void registerReceiveFromHandler(ReceiveFromFunc receiveFromFunc) = 0;
 
   /**
-  Unregisters data handler. The handler remains empty. All icoming data are silently discarded
+  Unregisters data handler. The handler remains empty. All icoming data are silently discarded.
+  When called outside of the handler, the handler isn't running in any thread after return
   */
   virtual void unregisterReceiveFromHandler() = 0;
 
@@ -21,6 +21,14 @@
 #include <sstream>
 #include <iomanip>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <vector>
+#include <stdint.h>
 
 static const long TRC_DEFAULT_FILE_MAXSIZE(10 * 1024 * 1024);
 
@@ -36,6 +44,10 @@ namespace iqrf { \
 #define TRC_START(filename, level, filesize) \
 iqrf::Tracer::getTracer().start(filename, level, filesize);
 
+// Starts tracing by background thread, see Tracer::startAsync()
+#define TRC_START_ASYNC(filename, level, filesize) \
+iqrf::Tracer::getTracer().startAsync(filename, level, filesize);
+
 #define TRC_STOP() \
 iqrf::Tracer::getTracer().stop();
 
@@ -150,6 +162,23 @@ namespace iqrf {
 
   class Tracer {
   public:
+    /// Asynchronous tracing parameters
+    struct AsyncConfig
+    {
+      AsyncConfig()
+        :ringSize(1024)
+        , flushPeriod(100)
+        , blockOnFull(false)
+      {}
+
+      /// max traces of one tracing thread waiting for the writer thread, rounded up to power of 2
+      size_t ringSize;
+      /// the writer thread writes and flushes waiting traces with this period
+      std::chrono::milliseconds flushPeriod;
+      /// tracing thread waits for room in full ring if true, the trace is dropped and counted otherwise
+      bool blockOnFull;
+    };
+
     static Tracer& getTracer();
 
     bool isOn(Level level)
@@ -157,33 +186,23 @@ namespace iqrf {
       return level <= m_level;
     }
 
-    void write(Level level, const std::string& msg)
+    void write(Level level, std::string msg)
     {
-      std::lock_guard<std::mutex> lck(m_mtx);
-
-      //time_t now = time(NULL);
-      //char   buff[32];
-      //strftime(buff, sizeof(buff), "%d-%m-%Y %H:%M:%S", localtime(&now));
-
-      using namespace std::chrono;
       auto nowTimePoint = std::chrono::system_clock::now();
-      auto nowTimePointUs = std::chrono::duration_cast<std::chrono::microseconds>(nowTimePoint.time_since_epoch()).count() % 1000000;
-      auto time = std::chrono::system_clock::to_time_t(nowTimePoint);
-      auto tm = *std::localtime(&time);
 
-      char buf[80];
-      strftime(buf, sizeof(buf), "%d-%m-%Y %H:%M:%S", &tm);
+      if (m_async && push(level, nowTimePoint, msg))
+        return;
+
+      std::lock_guard<std::mutex> lck(m_mtx);
 
       if (m_started) {
         if (m_cout) {
-          //std::cout << buff << " " << levelToChar(level) << msg;
-          std::cout << std::setfill('0') << std::setw(6) << buf << "." << nowTimePointUs << " " << levelToChar(level) << msg;
+          writeLine(std::cout, level, nowTimePoint, msg);
           std::cout.flush();
         }
         else {
           if (m_ofstream.is_open()) {
-            //m_ofstream << buff << " " << levelToChar(level) << msg;
-            m_ofstream << std::setfill('0') << std::setw(6) << buf << "." << nowTimePointUs << " " << levelToChar(level) << msg;
+            writeLine(m_ofstream, level, nowTimePoint, msg);
             m_ofstream.flush();
             if (m_ofstream.tellp() > m_maxSize)
             {
@@ -196,6 +215,8 @@ namespace iqrf {
 
     void start(const std::string& fname, Level level = Level::dbg, long maxSize = TRC_DEFAULT_FILE_MAXSIZE)
     {
+      stopWriter();
+
       std::lock_guard<std::mutex> lck(m_mtx);
       closeFile();
 
@@ -210,20 +231,341 @@ namespace iqrf {
       m_started = true;
     }
 
+    /// \brief Start tracing by background writer thread
+    /// \details
+    /// Each tracing thread only puts traces to its own lock-free ring, the threads don't contend.
+    /// The writer thread merges the rings by trace time, formats the traces and writes them in batches,
+    /// the output is flushed once per batch. Traces are ordered by time within a batch.
+    /// Error traces and half full ring wake up the writer before AsyncConfig::flushPeriod elapses.
+    /// Traces from destructors of static objects are written synchronously, the ring of the thread is released then.
+    void startAsync(const std::string& fname, Level level = Level::dbg, long maxSize = TRC_DEFAULT_FILE_MAXSIZE,
+      const AsyncConfig& cfg = AsyncConfig())
+    {
+      start(fname, level, maxSize);
+
+      size_t ringSize = 2;
+      while (ringSize < cfg.ringSize)
+        ringSize <<= 1;
+      if (ringSize != m_ringSize) {
+        m_ringSize = ringSize;
+        m_generation++;
+      }
+
+      m_flushPeriod = cfg.flushPeriod;
+      m_blockOnFull = cfg.blockOnFull;
+      m_writerRunning = true;
+      m_writerThread = std::thread(&Tracer::runWriter, this);
+      m_async = true;
+    }
+
     void stop()
     {
+      stopWriter();
+
       std::lock_guard<std::mutex> lck(m_mtx);
       closeFile();
       m_started = false;
     }
 
+    /// \brief Get number of traces dropped for full ring
+    uint64_t getDropped() const
+    {
+      std::lock_guard<std::mutex> lck(m_buffersMtx);
+      return countDropped();
+    }
+
   private:
+    // trace waiting for the writer thread
+    struct TraceEntry
+    {
+      Level mLevel;
+      std::chrono::system_clock::time_point mTime;
+      std::string mMsg;
+    };
+
+    // single producer single consumer ring of one tracing thread
+    struct ThreadBuffer
+    {
+      ThreadBuffer(size_t size, unsigned generation)
+        :mEntries(size)
+        , mMask(size - 1)
+        , mGeneration(generation)
+      {
+        mHead = 0;
+        mDropped = 0;
+        mTail = 0;
+        mPushing = false;
+        mExited = false;
+      }
+
+      std::vector<TraceEntry> mEntries;
+      size_t mMask;
+      unsigned mGeneration;
+      // written by the tracing thread
+      std::atomic<size_t> mHead;
+      std::atomic<uint64_t> mDropped;
+      // keeps the index written by the writer thread in another cache line
+      char mPad[64];
+      std::atomic<size_t> mTail;
+      // push in progress, stopWriter() waits for it
+      std::atomic_bool mPushing;
+      // the thread exited or got a new buffer, released once drained
+      std::atomic_bool mExited;
+    };
+
+    // thread_local owner of the buffer of a tracing thread
+    struct ThreadBufferHolder
+    {
+      ~ThreadBufferHolder()
+      {
+        threadBufferReleased() = true;
+        if (mBuffer)
+          mBuffer->mExited = true;
+      }
+
+      std::shared_ptr<ThreadBuffer> mBuffer;
+    };
+
     Tracer()
       : m_cout(false)
       , m_maxSize(-1)
       , m_started(false)
       , m_level(Level::dbg)
+      , m_droppedRemoved(0)
+      , m_droppedReported(0)
+    {
+      m_async = false;
+      m_blockOnFull = false;
+      m_ringSize = 0;
+      m_generation = 0;
+      m_writerRunning = false;
+      m_writerSleeping = false;
+    }
+
+    ~Tracer()
     {
+      stopWriter();
+    }
+
+    void writeLine(std::ostream& os, Level level, const std::chrono::system_clock::time_point& timePoint, const std::string& msg)
+    {
+      auto timePointUs = std::chrono::duration_cast<std::chrono::microseconds>(timePoint.time_since_epoch()).count() % 1000000;
+      auto time = std::chrono::system_clock::to_time_t(timePoint);
+      auto tm = *std::localtime(&time);
+
+      char buf[80];
+      strftime(buf, sizeof(buf), "%d-%m-%Y %H:%M:%S", &tm);
+
+      os << std::setfill('0') << std::setw(6) << buf << "." << timePointUs << " " << levelToChar(level) << msg;
+    }
+
+    // set once the holder of the thread is destroyed, e.g. the main thread holder before static objects
+    // trivially destructible, so it is readable by destructors of static objects
+    static bool& threadBufferReleased()
+    {
+      static thread_local bool released = false;
+      return released;
+    }
+
+    // returns nullptr if the holder of the thread is already destroyed
+    ThreadBuffer* threadBuffer()
+    {
+      if (threadBufferReleased())
+        return nullptr;
+
+      static thread_local ThreadBufferHolder holder;
+
+      unsigned generation = m_generation;
+      if (!holder.mBuffer || holder.mBuffer->mGeneration != generation) {
+        if (holder.mBuffer)
+          holder.mBuffer->mExited = true;
+        holder.mBuffer = std::make_shared<ThreadBuffer>(m_ringSize, generation);
+
+        std::lock_guard<std::mutex> lck(m_buffersMtx);
+        m_buffers.push_back(holder.mBuffer);
+      }
+      return holder.mBuffer.get();
+    }
+
+    // the tracing thread is the only producer of its buffer, it doesn't lock
+    // returns false if the writer was stopped meanwhile or the thread has no buffer any more,
+    // the trace is to be written synchronously
+    bool push(Level level, const std::chrono::system_clock::time_point& timePoint, std::string& msg)
+    {
+      ThreadBuffer* bufferPtr = threadBuffer();
+      if (!bufferPtr)
+        return false;
+      ThreadBuffer& buffer = *bufferPtr;
+
+      // either stopWriter() sees the push in progress or the push sees the writer stopped
+      buffer.mPushing = true;
+      if (!m_async) {
+        buffer.mPushing = false;
+        return false;
+      }
+
+      size_t head = buffer.mHead.load(std::memory_order_relaxed);
+      while (head - buffer.mTail.load(std::memory_order_acquire) > buffer.mMask) {
+        // full ring
+        if (!m_blockOnFull || !m_writerRunning) {
+          buffer.mDropped.store(buffer.mDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+          buffer.mPushing = false;
+          return true;
+        }
+        wakeWriter();
+        std::this_thread::yield();
+      }
+
+      TraceEntry& entry = buffer.mEntries[head & buffer.mMask];
+      entry.mLevel = level;
+      entry.mTime = timePoint;
+      entry.mMsg.swap(msg);
+      buffer.mHead.store(head + 1, std::memory_order_release);
+      buffer.mPushing = false;
+
+      if (level == Level::err || head + 1 - buffer.mTail.load(std::memory_order_relaxed) > buffer.mMask / 2)
+        wakeWriter();
+      return true;
+    }
+
+    void wakeWriter()
+    {
+      // the wake-up may be missed if the writer is just falling asleep, it is late by flushPeriod then
+      if (m_writerSleeping.load(std::memory_order_relaxed) && m_writerSleeping.exchange(false)) {
+        m_writerCv.notify_one();
+      }
+    }
+
+    // called with m_buffersMtx locked
+    uint64_t countDropped() const
+    {
+      uint64_t dropped = m_droppedRemoved;
+      for (auto& buffer : m_buffers)
+        dropped += buffer->mDropped;
+      return dropped;
+    }
+
+    // write ready traces of all threads merged by time, returns number of traces written
+    size_t writeBatch(std::ostream& os)
+    {
+      {
+        std::lock_guard<std::mutex> lck(m_buffersMtx);
+        m_writerBuffers.assign(m_buffers.begin(), m_buffers.end());
+      }
+
+      // traces put meanwhile are left for the next batch
+      m_writerEnds.resize(m_writerBuffers.size());
+      for (size_t i = 0; i < m_writerBuffers.size(); i++)
+        m_writerEnds[i] = m_writerBuffers[i]->mHead.load(std::memory_order_acquire);
+
+      size_t count = 0;
+      while (true) {
+        // the oldest trace at the rings tails
+        ThreadBuffer* next = nullptr;
+        const TraceEntry* nextEntry = nullptr;
+        for (size_t i = 0; i < m_writerBuffers.size(); i++) {
+          ThreadBuffer* buffer = m_writerBuffers[i].get();
+          size_t tail = buffer->mTail.load(std::memory_order_relaxed);
+          if (tail == m_writerEnds[i])
+            continue;
+          const TraceEntry& entry = buffer->mEntries[tail & buffer->mMask];
+          if (!nextEntry || entry.mTime < nextEntry->mTime) {
+            next = buffer;
+            nextEntry = &entry;
+          }
+        }
+        if (!next)
+          break;
+
+        size_t tail = next->mTail.load(std::memory_order_relaxed);
+        TraceEntry& entry = next->mEntries[tail & next->mMask];
+        writeLine(os, entry.mLevel, entry.mTime, entry.mMsg);
+        // the message memory is released here, not by the tracing thread
+        std::string().swap(entry.mMsg);
+        next->mTail.store(tail + 1, std::memory_order_release);
+        count++;
+      }
+
+      uint64_t dropped;
+      {
+        std::lock_guard<std::mutex> lck(m_buffersMtx);
+        // buffers of exited threads are released once drained
+        for (auto it = m_buffers.begin(); it != m_buffers.end();) {
+          ThreadBuffer& buffer = **it;
+          if (buffer.mExited && buffer.mTail.load(std::memory_order_relaxed) == buffer.mHead.load(std::memory_order_acquire)) {
+            m_droppedRemoved += buffer.mDropped;
+            it = m_buffers.erase(it);
+          }
+          else {
+            it++;
+          }
+        }
+        dropped = countDropped();
+      }
+      m_writerBuffers.clear();
+
+      if (dropped != m_droppedReported) {
+        std::ostringstream ostr;
+        ostr << " Tracer::runWriter()" << std::endl << dropped - m_droppedReported << " traces dropped for full ring" << std::endl;
+        writeLine(os, Level::war, std::chrono::system_clock::now(), ostr.str());
+        m_droppedReported = dropped;
+        count++;
+      }
+      return count;
+    }
+
+    void writeRings()
+    {
+      std::lock_guard<std::mutex> lck(m_mtx);
+      if (m_started) {
+        std::ostream& os = m_cout ? std::cout : m_ofstream;
+        if (writeBatch(os) > 0) {
+          os.flush();
+          if (!m_cout && m_ofstream.tellp() > m_maxSize)
+            resetFile();
+        }
+      }
+    }
+
+    void runWriter()
+    {
+      while (true) {
+        bool running = m_writerRunning;
+        writeRings();
+        // traces put before stop are written
+        if (!running)
+          break;
+
+        std::unique_lock<std::mutex> lck(m_writerMtx);
+        m_writerSleeping = true;
+        m_writerCv.wait_for(lck, m_flushPeriod, [&] { return !m_writerSleeping || !m_writerRunning; });
+        m_writerSleeping = false;
+      }
+    }
+
+    void stopWriter()
+    {
+      if (!m_writerThread.joinable())
+        return;
+
+      // new traces are written synchronously
+      m_async = false;
+      {
+        std::lock_guard<std::mutex> lck(m_writerMtx);
+        m_writerRunning = false;
+      }
+      m_writerCv.notify_one();
+      m_writerThread.join();
+
+      // pushes which passed the m_async check before it was cleared are written here
+      {
+        std::lock_guard<std::mutex> lck(m_buffersMtx);
+        for (auto& buffer : m_buffers) {
+          while (buffer->mPushing)
+            std::this_thread::yield();
+        }
+      }
+      writeRings();
     }
 
     void openFile()
@@ -280,6 +622,27 @@ namespace iqrf {
     long m_maxSize;
     Level m_level;
 
+    // asynchronous tracing
+    std::atomic_bool m_async;
+    std::atomic<size_t> m_ringSize;
+    // changed ring size makes the tracing threads allocate new buffers
+    std::atomic<unsigned> m_generation;
+    mutable std::mutex m_buffersMtx;
+    std::vector<std::shared_ptr<ThreadBuffer>> m_buffers;
+    // dropped traces of released buffers
+    uint64_t m_droppedRemoved;
+    uint64_t m_droppedReported;
+    // used by the writer thread only
+    std::vector<std::shared_ptr<ThreadBuffer>> m_writerBuffers;
+    std::vector<size_t> m_writerEnds;
+    std::atomic_bool m_blockOnFull;
+    std::chrono::milliseconds m_flushPeriod;
+    std::atomic_bool m_writerRunning;
+    std::atomic_bool m_writerSleeping;
+    std::mutex m_writerMtx;
+    std::condition_variable m_writerCv;
+    std::thread m_writerThread;
+
   };
 
   class TracerHexString
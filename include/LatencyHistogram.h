@@ -0,0 +1,113 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+/// \class LatencyHistogram
+/// \brief Lock-free histogram of durations with power of 2 microsecond buckets
+/// \details
+/// Bucket 0 counts durations below 1 us, bucket N counts durations in <2^(N-1), 2^N) us,
+/// the last bucket counts everything longer. Values may be added concurrently from more threads.
+class LatencyHistogram
+{
+public:
+  static const unsigned BUCKETS = 32;
+
+  /// Histogram content at the time of getSnapshot()
+  struct Snapshot
+  {
+    Snapshot()
+      :buckets(BUCKETS, 0)
+      , count(0)
+      , sumUs(0)
+      , maxUs(0)
+    {}
+
+    /// \brief Get upper bound of the bucket containing given percentile
+    /// \param [in] p percentile <0, 100>
+    /// \return upper bound in microseconds
+    uint64_t percentileUs(double p) const
+    {
+      if (count == 0)
+        return 0;
+      uint64_t rank = (uint64_t)(count * p / 100.0);
+      uint64_t acc = 0;
+      for (unsigned i = 0; i < BUCKETS; i++) {
+        acc += buckets[i];
+        if (acc > rank)
+          return (uint64_t)1 << i;
+      }
+      return maxUs;
+    }
+
+    std::vector<uint64_t> buckets;
+    uint64_t count;
+    uint64_t sumUs;
+    uint64_t maxUs;
+  };
+
+  LatencyHistogram()
+  {
+    for (unsigned i = 0; i < BUCKETS; i++)
+      m_buckets[i] = 0;
+    m_count = 0;
+    m_sumUs = 0;
+    m_maxUs = 0;
+  }
+
+  void add(std::chrono::nanoseconds duration)
+  {
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    if (us < 0)
+      us = 0;
+
+    unsigned bucket = 0;
+    while (bucket < BUCKETS - 1 && ((uint64_t)1 << bucket) <= (uint64_t)us)
+      bucket++;
+
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sumUs.fetch_add(us, std::memory_order_relaxed);
+
+    uint64_t max = m_maxUs.load(std::memory_order_relaxed);
+    while ((uint64_t)us > max && !m_maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed));
+  }
+
+  Snapshot getSnapshot() const
+  {
+    Snapshot snapshot;
+    for (unsigned i = 0; i < BUCKETS; i++)
+      snapshot.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    snapshot.count = m_count.load(std::memory_order_relaxed);
+    snapshot.sumUs = m_sumUs.load(std::memory_order_relaxed);
+    snapshot.maxUs = m_maxUs.load(std::memory_order_relaxed);
+    return snapshot;
+  }
+
+private:
+  LatencyHistogram(const LatencyHistogram&);
+  LatencyHistogram& operator = (const LatencyHistogram&);
+
+  std::atomic<uint64_t> m_buckets[BUCKETS];
+  std::atomic<uint64_t> m_count;
+  std::atomic<uint64_t> m_sumUs;
+  std::atomic<uint64_t> m_maxUs;
+};
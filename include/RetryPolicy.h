@@ -0,0 +1,148 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+/// \class RetryPolicy
+/// \brief Exponential back-off with jitter and total deadline
+/// \details
+/// Shared by the channels to pace repeated attempts of an operation refused by the peer as busy.
+/// The delay starts at initialDelay and is multiplied after each attempt up to maxDelay.
+/// A random part of the delay (jitter) is subtracted to spread concurrent retries.
+/// Retrying stops after maxAttempts or when the deadline measured from the first attempt expires.
+/// Number of retries and give-ups is counted and may be read for statistics.
+class RetryPolicy
+{
+public:
+  /// Policy parameters
+  struct Config
+  {
+    Config()
+      :maxAttempts(8)
+      , initialDelay(std::chrono::milliseconds(1))
+      , maxDelay(std::chrono::milliseconds(100))
+      , deadline(std::chrono::milliseconds(500))
+      , multiplier(2.0)
+      , jitter(0.5)
+    {}
+
+    /// max number of attempts including the first one, 0 means limited by deadline only
+    unsigned maxAttempts;
+    /// delay after the first attempt
+    std::chrono::microseconds initialDelay;
+    /// delay cap
+    std::chrono::microseconds maxDelay;
+    /// total time budget measured from the first attempt, 0 means limited by maxAttempts only
+    std::chrono::microseconds deadline;
+    /// delay growth factor
+    double multiplier;
+    /// fraction <0, 1> of the delay randomly cut off
+    double jitter;
+  };
+
+  /// \class Backoff
+  /// \brief State of one retried operation
+  /// \details
+  /// Created before the first attempt. After each failed attempt nextDelay() provides
+  /// the time to wait before the next attempt or returns false if it is time to give up.
+  class Backoff
+  {
+  public:
+    Backoff(RetryPolicy& policy)
+      :m_policy(policy)
+      , m_attempts(1)
+      , m_delay(policy.m_cfg.initialDelay)
+      , m_start(std::chrono::steady_clock::now())
+    {}
+
+    /// \brief Get delay before the next attempt
+    /// \param [out] delay time to wait
+    /// \return false if the retry budget is exhausted
+    bool nextDelay(std::chrono::microseconds& delay)
+    {
+      const Config& cfg = m_policy.m_cfg;
+
+      if (cfg.maxAttempts > 0 && m_attempts >= cfg.maxAttempts) {
+        m_policy.m_giveUps++;
+        return false;
+      }
+
+      delay = std::min(m_delay, cfg.maxDelay);
+      if (cfg.jitter > 0) {
+        std::uniform_real_distribution<double> dist(0, std::min(cfg.jitter, 1.0));
+        delay -= std::chrono::microseconds((int64_t)(delay.count() * dist(randomEngine())));
+      }
+
+      if (cfg.deadline.count() > 0) {
+        auto remaining = cfg.deadline -
+          std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start);
+        if (remaining.count() <= 0) {
+          m_policy.m_giveUps++;
+          return false;
+        }
+        // last attempt just at the deadline
+        delay = std::min(delay, remaining);
+      }
+
+      m_delay = std::chrono::microseconds((int64_t)(std::min(m_delay.count() * cfg.multiplier, (double)cfg.maxDelay.count())));
+      m_attempts++;
+      m_policy.m_retries++;
+      return true;
+    }
+
+    /// \brief Get number of attempts made so far
+    unsigned attempts() const { return m_attempts; }
+
+  private:
+    RetryPolicy& m_policy;
+    unsigned m_attempts;
+    std::chrono::microseconds m_delay;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  RetryPolicy(const Config& cfg = Config())
+    :m_cfg(cfg)
+  {
+    m_retries = 0;
+    m_giveUps = 0;
+  }
+
+  const Config& getConfig() const { return m_cfg; }
+
+  /// \brief Get number of retries since creation
+  uint64_t getRetries() const { return m_retries; }
+
+  /// \brief Get number of operations given up since creation
+  uint64_t getGiveUps() const { return m_giveUps; }
+
+private:
+  static std::minstd_rand& randomEngine()
+  {
+    static thread_local std::minstd_rand engine((unsigned)
+      std::chrono::steady_clock::now().time_since_epoch().count());
+    return engine;
+  }
+
+  Config m_cfg;
+  std::atomic<uint64_t> m_retries;
+  std::atomic<uint64_t> m_giveUps;
+};
@@ -22,18 +22,33 @@
 #include <atomic>
 #include <condition_variable>
 #include <queue>
+#include <stdint.h>
+
+/// Which task is dropped if the bounded TaskQueue is full
+enum class QueueDropPolicy {
+  /// the pushed task
+  DropNewest,
+  /// the oldest queued task
+  DropOldest
+};
 
 /// \class TaskQueue
 /// \brief Maintain queue of tasks and invoke sequential processing
 /// \details
 /// Provide asynchronous processing of incoming tasks of type T in dedicated worker thread.
 /// The tasks are processed in FIFO way. Processing function is passed as parameter in constructor.
+/// The queue may be bounded, a task pushed to the full queue is then dropped according to DropPolicy
+/// so the pushing thread is never blocked by slow processing.
+/// Urgent tasks pushed by pushUrgent() overtake the other queued tasks, all tasks are still processed
+/// one by one by the worker thread.
 template <class T>
 class TaskQueue
 {
 public:
-  /// Processing function type
-  typedef std::function<void(T)> ProcessTaskFunc;
+  /// Processing function type, the task is moved out of the queue
+  typedef std::function<void(T&&)> ProcessTaskFunc;
+
+  typedef QueueDropPolicy DropPolicy;
 
   /// \brief constructor
   /// \param [in] processTaskFunc processing function
@@ -41,8 +56,20 @@ public:
   /// Processing function is used in dedicated worker thread to process incoming queued tasks.
   /// The function must be thread safe. The worker thread is started.
   TaskQueue(ProcessTaskFunc processTaskFunc)
+    :TaskQueue(processTaskFunc, 0, DropPolicy::DropNewest)
+  {
+  }
+
+  /// \brief constructor of bounded queue
+  /// \param [in] processTaskFunc processing function
+  /// \param [in] maxSize max number of queued tasks, 0 means unbounded
+  /// \param [in] dropPolicy task dropped if the queue is full
+  TaskQueue(ProcessTaskFunc processTaskFunc, size_t maxSize, DropPolicy dropPolicy)
     :m_processTaskFunc(processTaskFunc)
+    , m_maxSize(maxSize)
+    , m_dropPolicy(dropPolicy)
   {
+    m_dropped = 0;
     m_taskPushed = false;
     m_runWorkerThread = true;
     m_workerThread = std::thread(&TaskQueue::worker, this);
@@ -69,14 +96,60 @@ public:
   /// \return size of queue
   /// \details
   /// Pushes task to queue to be processed in worker thread. The task type T has to be copyable
-  /// as the copy is pushed to queue container
+  /// as the copy is pushed to queue container. If the bounded queue is full a task is dropped.
   int pushToQueue(const T& task)
+  {
+    return pushToQueue(T(task));
+  }
+
+  /// \brief Push task to queue without copy
+  /// \param [in] task object moved to queue
+  /// \return size of queue
+  int pushToQueue(T&& task)
   {
     int retval = 0;
     {
       std::unique_lock<std::mutex> lck(m_taskQueueMutex);
-      m_taskQueue.push(task);
-      retval = m_taskQueue.size();
+      if (m_maxSize > 0 && m_taskQueue.size() + m_urgentQueue.size() >= m_maxSize) {
+        m_dropped++;
+        if (m_dropPolicy == DropPolicy::DropNewest || m_taskQueue.empty()) {
+          return m_taskQueue.size() + m_urgentQueue.size();
+        }
+        m_taskQueue.pop();
+      }
+      m_taskQueue.push(std::move(task));
+      retval = m_taskQueue.size() + m_urgentQueue.size();
+      m_taskPushed = true;
+    }
+    m_conditionVariable.notify_all();
+    return retval;
+  }
+
+  /// \brief Push task processed before the tasks pushed by pushToQueue()
+  /// \param [in] task object moved to queue
+  /// \return size of queue
+  /// \details
+  /// Urgent tasks are processed in FIFO way among themselves. If the bounded queue is full the oldest
+  /// not urgent task is dropped, DropPolicy applies only if all queued tasks are urgent.
+  int pushUrgent(T&& task)
+  {
+    int retval = 0;
+    {
+      std::unique_lock<std::mutex> lck(m_taskQueueMutex);
+      if (m_maxSize > 0 && m_taskQueue.size() + m_urgentQueue.size() >= m_maxSize) {
+        m_dropped++;
+        if (!m_taskQueue.empty()) {
+          m_taskQueue.pop();
+        }
+        else if (m_dropPolicy == DropPolicy::DropNewest) {
+          return m_urgentQueue.size();
+        }
+        else {
+          m_urgentQueue.pop();
+        }
+      }
+      m_urgentQueue.push(std::move(task));
+      retval = m_taskQueue.size() + m_urgentQueue.size();
       m_taskPushed = true;
     }
     m_conditionVariable.notify_all();
@@ -103,11 +176,17 @@ public:
     size_t retval = 0;
     {
       std::unique_lock<std::mutex> lck(m_taskQueueMutex);
-      retval = m_taskQueue.size();
+      retval = m_taskQueue.size() + m_urgentQueue.size();
     }
     return retval;
   }
 
+  /// \brief Get number of tasks dropped for full queue
+  uint64_t getDropped() const
+  {
+    return m_dropped;
+  }
+
 private:
   /// Worker thread function
   void worker()
@@ -123,11 +202,12 @@ private:
       m_taskPushed = false;
 
       while (m_runWorkerThread) {
-        if (!m_taskQueue.empty()) {
-          auto task = m_taskQueue.front();
-          m_taskQueue.pop();
+        if (!m_urgentQueue.empty() || !m_taskQueue.empty()) {
+          std::queue<T>& queue = m_urgentQueue.empty() ? m_taskQueue : m_urgentQueue;
+          T task(std::move(queue.front()));
+          queue.pop();
           lck.unlock();
-          m_processTaskFunc(task);
+          m_processTaskFunc(std::move(task));
         }
         else {
           lck.unlock();
@@ -141,9 +221,14 @@ private:
   std::mutex m_taskQueueMutex;
   std::condition_variable m_conditionVariable;
   std::queue<T> m_taskQueue;
+  // processed before m_taskQueue
+  std::queue<T> m_urgentQueue;
   bool m_taskPushed;
   bool m_runWorkerThread;
   std::thread m_workerThread;
 
   ProcessTaskFunc m_processTaskFunc;
+  size_t m_maxSize;
+  DropPolicy m_dropPolicy;
+  std::atomic<uint64_t> m_dropped;
 };
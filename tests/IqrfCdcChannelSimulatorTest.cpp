@@ -0,0 +1,167 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Loopback of IqrfCdcChannel against CdcSimulator pty
+// checks the CDC framing of data send replies OK, BUSY, ERR and of asynchronous data
+
+#include "IqrfCdcChannel.h"
+#include "CdcSimulator.h"
+#include "IqrfLogging.h"
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+TRC_INIT();
+
+typedef std::basic_string<unsigned char> ustring;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  if (!(cond)) { std::cerr << __FILE__ << ":" << __LINE__ << " failed: " #cond << std::endl; ++failures; }
+
+// collects messages received by the channel
+class Receiver
+{
+public:
+  int onReceive(const ustring& msg)
+  {
+    std::unique_lock<std::mutex> lck(m_mtx);
+    m_received.push_back(msg);
+    m_cv.notify_all();
+    return 0;
+  }
+
+  bool waitFor(size_t count)
+  {
+    std::unique_lock<std::mutex> lck(m_mtx);
+    return m_cv.wait_for(lck, std::chrono::seconds(2), [&] { return m_received.size() >= count; });
+  }
+
+  ustring at(size_t i)
+  {
+    std::unique_lock<std::mutex> lck(m_mtx);
+    return m_received.at(i);
+  }
+
+private:
+  std::mutex m_mtx;
+  std::condition_variable m_cv;
+  std::vector<ustring> m_received;
+};
+
+static ustring toUstring(const std::string& str)
+{
+  return ustring((const unsigned char*)str.data(), str.size());
+}
+
+static void testSendOk()
+{
+  CdcSimulator sim;
+  // the reply contains CR and ':' to check the length is honored
+  sim.setResponder([](const ustring& data) { return data + toUstring(":\r"); });
+
+  IqrfCdcChannel channel(sim.getPortName());
+  Receiver receiver;
+  channel.registerReceiveFromHandler([&](const ustring& msg) { return receiver.onReceive(msg); });
+
+  ustring msg = toUstring("\x01\x00\x0d:\x3a\xff");
+  channel.sendTo(msg);
+  CHECK(receiver.waitFor(1));
+  CHECK(receiver.at(0) == msg + toUstring(":\r"));
+  CHECK(sim.getStats().dataReceived == 1);
+  CHECK(channel.getStats().sent == 1);
+  CHECK(channel.getState() == IChannel::State::Ready);
+}
+
+static void testSendBusy()
+{
+  CdcSimulator::Config simCfg;
+  simCfg.busyProbability = 1;
+  CdcSimulator sim(simCfg);
+
+  IqrfCdcChannel::Config cfg;
+  cfg.busyRetry.maxAttempts = 3;
+  IqrfCdcChannel channel(sim.getPortName(), cfg);
+
+  bool thrown = false;
+  try {
+    channel.sendTo(toUstring("busy"));
+  }
+  catch (CDCImplException&) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  CHECK(sim.getStats().busyReplies == 3);
+  CHECK(channel.getStats().busyGiveUps == 1);
+  CHECK(channel.getStats().sent == 0);
+}
+
+static void testSendErr()
+{
+  CdcSimulator::Config simCfg;
+  simCfg.errProbability = 1;
+  CdcSimulator sim(simCfg);
+
+  IqrfCdcChannel channel(sim.getPortName());
+
+  bool thrown = false;
+  try {
+    channel.sendTo(toUstring("err"));
+  }
+  catch (CDCImplException&) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  CHECK(sim.getStats().errReplies == 1);
+  CHECK(channel.getStats().sent == 0);
+}
+
+static void testAsyncData()
+{
+  CdcSimulator sim;
+  IqrfCdcChannel channel(sim.getPortName());
+  Receiver receiver;
+  channel.registerReceiveFromHandler([&](const ustring& msg) { return receiver.onReceive(msg); });
+
+  ustring first = toUstring("async");
+  ustring second(255, 0x0d);
+  sim.sendAsyncData(first);
+  sim.sendAsyncData(second);
+  CHECK(receiver.waitFor(2));
+  CHECK(receiver.at(0) == first);
+  CHECK(receiver.at(1) == second);
+  CHECK(sim.getStats().asyncSent == 2);
+}
+
+int main()
+{
+  try {
+    testSendOk();
+    testSendBusy();
+    testSendErr();
+    testAsyncData();
+  }
+  catch (std::exception& e) {
+    std::cerr << "unexpected exception: " << e.what() << std::endl;
+    ++failures;
+  }
+
+  if (failures > 0)
+    std::cerr << failures << " checks failed" << std::endl;
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tracing from a destructor of a static object while the async writer runs
+// the thread_local ring of the main thread is already destroyed then, the trace is written synchronously
+
+#include "IqrfLogging.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdlib>
+
+TRC_INIT();
+
+static const char* TRACE_FILE = "TracerStaticDestructorTest.txt";
+static const char* STATIC_TRACE = "traced from static destructor";
+
+static bool fileContains(const std::string& text)
+{
+  std::ifstream in(TRACE_FILE);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.find(text) != std::string::npos)
+      return true;
+  }
+  return false;
+}
+
+// constructed after the tracer, so destroyed before it
+class TracingAtExit
+{
+public:
+  ~TracingAtExit()
+  {
+    TRC_INF(STATIC_TRACE);
+    // main() already returned, the failure is reported by the exit code
+    if (!fileContains(STATIC_TRACE)) {
+      std::cerr << "trace from static destructor not written" << std::endl;
+      std::_Exit(1);
+    }
+  }
+};
+
+static TracingAtExit tracingAtExit;
+
+int main()
+{
+  iqrf::Tracer::getTracer().startAsync(TRACE_FILE, iqrf::Level::dbg, TRC_DEFAULT_FILE_MAXSIZE);
+  // the main thread gets its ring
+  TRC_INF("traced from main");
+  return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * Copyright 2016-2017 MICRORISC s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Loopback ping-pong round trip latency of UdpChannel, blocking or busy-poll receive
+// usage: UdpBusyPollBenchmark [busypoll] [pin] [count=N]
+
+#include "UdpChannel.h"
+#include "IqrfLogging.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+TRC_INIT();
+
+int main(int argc, char** argv)
+{
+  UdpChannel::Config cfg;
+  unsigned count = 20000;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strcmp(argv[i], "busypoll"))
+      cfg.busyPoll = true;
+    else if (0 == strcmp(argv[i], "pin"))
+      cfg.pinShards = true;
+    else if (0 == strncmp(argv[i], "count=", 6))
+      count = (unsigned)atoi(argv[i] + 6);
+    else {
+      std::cerr << "usage: " << argv[0] << " [busypoll] [pin] [count=N]" << std::endl;
+      return 1;
+    }
+  }
+  if (count == 0)
+    count = 1;
+
+  const unsigned short port = 55100;
+  UdpChannel channel(port + 1, port, 1024, cfg);
+  // echo each datagram back to its source
+  channel.registerReceiveFromPeerHandler([&](const std::basic_string<unsigned char>& msg, const sockaddr_in& from) {
+    channel.sendTo(from, msg);
+    return 0;
+  });
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    std::cerr << "socket failed: " << errno << std::endl;
+    return 1;
+  }
+  sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  timeval timeout;
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::vector<double> rtt;
+  rtt.reserve(count);
+  char buf[64];
+  for (unsigned i = 0; i < count; i++) {
+    auto start = std::chrono::steady_clock::now();
+    sendto(sock, "ping", 4, 0, (struct sockaddr *)&to, sizeof(to));
+    if (recv(sock, buf, sizeof(buf), 0) < 0) {
+      std::cerr << "no reply: " << errno << std::endl;
+      close(sock);
+      return 1;
+    }
+    rtt.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  }
+  close(sock);
+
+  std::sort(rtt.begin(), rtt.end());
+  UdpChannel::Stats stats = channel.getStats();
+  std::cout << "busyPoll: " << cfg.busyPoll << " pinShards: " << cfg.pinShards << " round trips: " << count << std::endl
+    << "rtt us p50: " << rtt[rtt.size() / 2]
+    << " p99: " << rtt[rtt.size() * 99 / 100]
+    << " p99.9: " << rtt[rtt.size() * 999 / 1000]
+    << " max: " << rtt.back() << std::endl
+    << "busy poll fallbacks: " << stats.busyPollFallbacks << std::endl;
+  return 0;
+}